@@ -0,0 +1,409 @@
+#include "httpd.h"
+#include "archive.h"
+#include "phash.h"
+#include <dirent.h>
+#include <map>
+#include <sys/mman.h>
+#include <zlib.h>
+
+/*
+ *  Packed-site archives: a whole docroot in one immutable file that the
+ *  server maps once at startup. Lookups go through a perfect-hash table in
+ *  the index, bodies are sent with sendfile() at offsets of the single fd,
+ *  so serving needs no per-file open/stat, and .htaccess rules are read
+ *  from the index instead of the docroot. Swapping sites
+ *  is a rename() of a freshly packed archive followed by SIGHUP.
+ */
+
+using namespace std;
+
+typedef struct pack_file {
+    string uri;
+    string fullpath;
+    string hdr;
+    string gz_hdr;
+    string gz;
+    string acl;                 // .htaccess of the directory it is served from
+    uint64_t size;
+} pack_file;
+
+
+/*
+ *  Returns 1 if path names a regular file, which the server then treats
+ *  as a packed archive instead of a docroot directory.
+ */
+int IsSiteArchive(string path) {
+
+    struct stat sb;
+    return stat(path.c_str(), &sb) == 0 && S_ISREG(sb.st_mode);
+}
+
+
+/*
+ *  Map an archive and validate its index. Returns 0 on success.
+ */
+int OpenSiteArchive(string path, struct site_archive * site) {
+
+    struct stat sb;
+    site->fd = -1;
+    site->base = NULL;
+
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        cerr << "open() failed for archive " << path << endl;
+        return -1;
+    }
+    if (fstat(fd, &sb) != 0 || (size_t)sb.st_size < sizeof(struct archive_header)) {
+        cerr << "archive " << path << " is truncated" << endl;
+        close(fd);
+        return -1;
+    }
+    void * base = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        cerr << "mmap() failed for archive " << path << endl;
+        close(fd);
+        return -1;
+    }
+
+    const struct archive_header * hdr = (const struct archive_header *)base;
+    uint64_t size = sb.st_size;
+    int ok = memcmp(hdr->magic, ARCHIVE_MAGIC, 8) == 0 &&
+             hdr->version == ARCHIVE_VERSION &&
+             hdr->file_size == size &&
+             hdr->num_buckets != 0 && (hdr->num_buckets & (hdr->num_buckets - 1)) == 0 &&
+             hdr->table_size != 0 && (hdr->table_size & (hdr->table_size - 1)) == 0 &&
+             hdr->entries_off + (uint64_t)hdr->num_entries * sizeof(struct archive_entry) <= size &&
+             hdr->disp_off + (uint64_t)hdr->num_buckets * 4 <= size &&
+             hdr->slots_off + (uint64_t)hdr->table_size * 4 <= size;
+    if (!ok) {
+        cerr << "archive " << path << " has a bad header" << endl;
+        munmap(base, sb.st_size);
+        close(fd);
+        return -1;
+    }
+
+    site->fd = fd;
+    site->path = path;
+    site->base = (const char *)base;
+    site->size = size;
+    site->hdr = hdr;
+    site->entries = (const struct archive_entry *)(site->base + hdr->entries_off);
+    site->disp = (const uint32_t *)(site->base + hdr->disp_off);
+    site->slots = (const uint32_t *)(site->base + hdr->slots_off);
+
+    // reject entries pointing outside the mapping so lookups never have to
+    for (uint32_t i = 0; i < hdr->num_entries; i++) {
+        const struct archive_entry * e = &site->entries[i];
+        if (e->path_off + e->path_len > size || e->hdr_off + e->hdr_len > size ||
+            e->body_off + e->body_len > size ||
+            e->gz_hdr_off + e->gz_hdr_len > size || e->gz_off + e->gz_len > size ||
+            e->acl_off + e->acl_len > size) {
+            cerr << "archive " << path << " has a bad entry" << endl;
+            CloseSiteArchive(site);
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < hdr->table_size; i++) {
+        if (site->slots[i] > hdr->num_entries) {
+            cerr << "archive " << path << " has a bad hash table" << endl;
+            CloseSiteArchive(site);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+void CloseSiteArchive(struct site_archive * site) {
+
+    if (site->base != NULL) {
+        munmap((void *)site->base, site->size);
+    }
+    if (site->fd >= 0) {
+        close(site->fd);
+    }
+    site->base = NULL;
+    site->fd = -1;
+}
+
+
+/*
+ *  Look up a request uri. Returns NULL if the archive has no such file.
+ */
+const struct archive_entry * FindArchiveEntry(const struct site_archive * site, string uri) {
+
+    const struct archive_header * hdr = site->hdr;
+    uint32_t slot = PHashSlot(site->disp, hdr->num_buckets, hdr->table_size,
+                              uri.data(), uri.size());
+    uint32_t idx = site->slots[slot];
+    if (idx == 0) {
+        return NULL;
+    }
+    const struct archive_entry * e = &site->entries[idx - 1];
+    if (e->path_len != uri.size() ||
+        memcmp(site->base + e->path_off, uri.data(), uri.size()) != 0) {
+        return NULL;
+    }
+    return e;
+}
+
+
+/*
+ *  The .htaccess rules of directory dir, empty if it has none.
+ */
+static string ReadRules(string dir) {
+
+    ifstream infile((dir + "/.htaccess").c_str());
+    return string((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+}
+
+
+/*
+ *  Recursively collect every servable file below dir, with the rules
+ *  CheckFile would check it against: only world readable regular files,
+ *  and .htaccess is never served. A symlink is packed as the file it
+ *  points to if that is inside root, under the rules of the directory it
+ *  is in; symlinked directories are not descended into, so a link cycle
+ *  cannot recurse forever.
+ */
+static void CollectFiles(string root, string rel, vector<struct pack_file> & files) {
+
+    DIR * dir = opendir((root + rel).c_str());
+    if (dir == NULL) {
+        cerr << "opendir() failed for " << root + rel << endl;
+        return;
+    }
+    string rules = ReadRules(root + rel);
+    struct dirent * ent;
+    while ((ent = readdir(dir)) != NULL) {
+        string name = ent->d_name;
+        if (name == "." || name == ".." || name == ".htaccess") {
+            continue;
+        }
+        string path = rel + "/" + name;
+        struct stat sb;
+        if (lstat((root + path).c_str(), &sb) != 0) {
+            continue;
+        }
+        if (S_ISDIR(sb.st_mode)) {
+            CollectFiles(root, path, files);
+            continue;
+        }
+        struct pack_file f;
+        f.uri = path;
+        f.fullpath = root + path;
+        f.acl = rules;
+        if (S_ISLNK(sb.st_mode)) {
+            char target[PATH_MAX];
+            if (realpath(f.fullpath.c_str(), target) == NULL ||
+                string(target).compare(0, root.size() + 1, root + "/") != 0 ||
+                stat(target, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+                cerr << "skipping link " << f.fullpath << endl;
+                continue;
+            }
+            f.fullpath = target;
+            f.acl = ReadRules(f.fullpath.substr(0, f.fullpath.rfind('/')));
+        }
+        if (S_ISREG(sb.st_mode) && (sb.st_mode & S_IROTH)) {
+            f.size = sb.st_size;
+            files.push_back(f);
+        }
+    }
+    closedir(dir);
+}
+
+
+static int IsCompressible(string content_type) {
+
+    return content_type.compare(0, 5, "text/") == 0 ||
+           content_type.find("javascript") != string::npos ||
+           content_type.find("json") != string::npos ||
+           content_type.find("xml") != string::npos;
+}
+
+
+/*
+ *  gzip-encode a whole file. Returns an empty string on failure.
+ */
+static string GzipFile(string fname) {
+
+    ifstream infile(fname.c_str(), ios::binary);
+    string in((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+    z_stream zs;
+    memset(&zs, 0, sizeof(zs));
+    if (deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return "";
+    }
+    string out(deflateBound(&zs, in.size()), '\0');
+    zs.next_in = (Bytef *)in.data();
+    zs.avail_in = in.size();
+    zs.next_out = (Bytef *)&out[0];
+    zs.avail_out = out.size();
+    int rc = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    return rc == Z_STREAM_END ? out : "";
+}
+
+
+static int WriteAll(int fd, const char * buf, size_t len) {
+
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/*
+ *  Pack every file under doc_root into a single archive at out_path.
+ *  The archive is written next to out_path and renamed into place, so a
+ *  running server never sees a half written file. If gzip is set, text
+ *  files also get a precompressed variant when that is smaller.
+ */
+int PackSite(string doc_root, string out_path, int gzip) {
+
+    char root[PATH_MAX];
+    if (realpath(doc_root.c_str(), root) == 0) {
+        cerr << "bad docroot " << doc_root << endl;
+        return -1;
+    }
+    vector<struct pack_file> files;
+    CollectFiles(root, "", files);
+
+    vector<string> keys;
+    for (size_t i = 0; i < files.size(); i++) {
+        struct http_res res = BuildHttpResponse(RESP_OK, files[i].fullpath);
+        if (res.code != RESP_OK) {
+            cerr << files[i].fullpath << " vanished while packing" << endl;
+            return -1;
+        }
+        files[i].hdr = ResponseFields(&res);
+        if (gzip && IsCompressible(res.content_type)) {
+            files[i].gz = GzipFile(files[i].fullpath);
+            if (!files[i].gz.empty() && files[i].gz.size() < files[i].size) {
+                // which copy is served depends on Accept-Encoding, and
+                // caches have to know that about both
+                res.vary = "Accept-Encoding";
+                files[i].hdr = ResponseFields(&res);
+                res.content_encoding = "gzip";
+                res.content_length = files[i].gz.size();
+                files[i].gz_hdr = ResponseFields(&res);
+            }
+            else {
+                files[i].gz.clear();
+            }
+        }
+        keys.push_back(files[i].uri);
+    }
+
+    struct phash_table table;
+    if (BuildPerfectHash(keys, &table) != 0) {
+        cerr << "could not build perfect hash for " << keys.size() << " files" << endl;
+        return -1;
+    }
+
+    // lay out index, strings, then bodies
+    struct archive_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, ARCHIVE_MAGIC, 8);
+    hdr.version = ARCHIVE_VERSION;
+    hdr.num_entries = files.size();
+    hdr.num_buckets = table.num_buckets;
+    hdr.table_size = table.table_size;
+    hdr.entries_off = sizeof(hdr);
+    hdr.disp_off = hdr.entries_off + files.size() * sizeof(struct archive_entry);
+    hdr.slots_off = hdr.disp_off + table.num_buckets * 4;
+
+    string strings;
+    uint64_t strings_off = hdr.slots_off + table.table_size * 4;
+    vector<struct archive_entry> entries(files.size());
+    // files of a directory share its rules
+    map<string, uint64_t> acls;
+    for (size_t i = 0; i < files.size(); i++) {
+        struct archive_entry & e = entries[i];
+        memset(&e, 0, sizeof(e));
+        e.path_off = strings_off + strings.size();
+        e.path_len = files[i].uri.size();
+        strings += files[i].uri;
+        e.hdr_off = strings_off + strings.size();
+        e.hdr_len = files[i].hdr.size();
+        strings += files[i].hdr;
+        if (!files[i].gz.empty()) {
+            e.gz_hdr_off = strings_off + strings.size();
+            e.gz_hdr_len = files[i].gz_hdr.size();
+            strings += files[i].gz_hdr;
+        }
+        if (!files[i].acl.empty()) {
+            if (!acls.count(files[i].acl)) {
+                acls[files[i].acl] = strings_off + strings.size();
+                strings += files[i].acl;
+            }
+            e.acl_off = acls[files[i].acl];
+            e.acl_len = files[i].acl.size();
+        }
+    }
+    uint64_t off = strings_off + strings.size();
+    for (size_t i = 0; i < files.size(); i++) {
+        entries[i].body_off = off;
+        entries[i].body_len = files[i].size;
+        off += files[i].size;
+        if (!files[i].gz.empty()) {
+            entries[i].gz_off = off;
+            entries[i].gz_len = files[i].gz.size();
+            off += files[i].gz.size();
+        }
+    }
+    hdr.file_size = off;
+
+    string tmp_path = out_path + ".tmp";
+    int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        cerr << "open() failed for " << tmp_path << endl;
+        return -1;
+    }
+    int rc = WriteAll(fd, (const char *)&hdr, sizeof(hdr));
+    if (!entries.empty()) {
+        rc |= WriteAll(fd, (const char *)&entries[0], entries.size() * sizeof(entries[0]));
+    }
+    rc |= WriteAll(fd, (const char *)&table.disp[0], table.disp.size() * 4);
+    rc |= WriteAll(fd, (const char *)&table.slots[0], table.slots.size() * 4);
+    rc |= WriteAll(fd, strings.data(), strings.size());
+    for (size_t i = 0; i < files.size() && rc == 0; i++) {
+        // copy the body as it was stat'ed; a file changing size mid-pack
+        // would shift every later offset, so treat that as an error
+        ifstream infile(files[i].fullpath.c_str(), ios::binary);
+        string body((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+        if (body.size() != files[i].size) {
+            cerr << files[i].fullpath << " changed while packing" << endl;
+            rc = -1;
+            break;
+        }
+        rc |= WriteAll(fd, body.data(), body.size());
+        rc |= WriteAll(fd, files[i].gz.data(), files[i].gz.size());
+    }
+    rc |= fsync(fd);
+    rc |= close(fd);
+    if (rc != 0) {
+        cerr << "failed writing " << tmp_path << endl;
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+    if (rename(tmp_path.c_str(), out_path.c_str()) != 0) {
+        cerr << "rename() failed for " << out_path << endl;
+        unlink(tmp_path.c_str());
+        return -1;
+    }
+    cerr << "packed " << files.size() << " files (" << off << " bytes) into "
+         << out_path << endl;
+    return 0;
+}
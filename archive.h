@@ -0,0 +1,75 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+/*
+ *  Packed-site archive layout (all integers in host byte order, so an
+ *  archive is only valid on machines of the endianness that packed it):
+ *
+ *  archive_header
+ *  archive_entry[num_entries]
+ *  uint32_t disp[num_buckets]        perfect-hash displacements
+ *  uint32_t slots[table_size]        entry index + 1, 0 if empty
+ *  strings                           uri paths and precomputed headers
+ *  bodies                            file contents, laid out back to back
+ *
+ *  Each entry carries the header fields that follow the status and Server
+ *  lines of a 200 response, so serving a hit is one send() plus one
+ *  sendfile() at the body offset of the archive fd. The .htaccess rules
+ *  of the directory a file was served from are kept as text and checked
+ *  per request, as CheckFile would check the file. Directories resolve as
+ *  on disk ("dir/" is dir/index.html, "dir" redirects to "dir/"), but
+ *  only through an index.html: there are no listings in archive mode.
+ */
+#define ARCHIVE_MAGIC   "HTTPDPK1"
+#define ARCHIVE_VERSION 2
+
+typedef struct archive_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t num_entries;
+    uint32_t num_buckets;
+    uint32_t table_size;
+    uint64_t entries_off;
+    uint64_t disp_off;
+    uint64_t slots_off;
+    uint64_t file_size;
+} archive_header;
+
+typedef struct archive_entry {
+    uint64_t path_off;
+    uint64_t hdr_off;
+    uint64_t body_off;
+    uint64_t body_len;
+    uint64_t gz_hdr_off;        // 0 if there is no gzip variant
+    uint64_t gz_off;
+    uint64_t gz_len;
+    uint64_t acl_off;           // .htaccess rules, 0 if there are none
+    uint32_t path_len;
+    uint32_t hdr_len;
+    uint32_t gz_hdr_len;
+    uint32_t acl_len;
+} archive_entry;
+
+typedef struct site_archive {
+    int fd;
+    string path;
+    const char * base;
+    size_t size;
+    const struct archive_header * hdr;
+    const struct archive_entry * entries;
+    const uint32_t * disp;
+    const uint32_t * slots;
+} site_archive;
+
+int IsSiteArchive(string path);
+int OpenSiteArchive(string path, struct site_archive * site);
+void CloseSiteArchive(struct site_archive * site);
+const struct archive_entry * FindArchiveEntry(const struct site_archive * site, string uri);
+int PackSite(string doc_root, string out_path, int gzip);
+
+#endif // ARCHIVE_H
@@ -0,0 +1,168 @@
+#include "httpd.h"
+#include "capture.h"
+#include <sys/time.h>
+#include <sys/uio.h>
+
+using namespace std;
+
+static int trace_fd = -1;
+static int trace_sample = 1;
+static uint64_t num_conns = 0;
+
+
+/*
+ *  Start appending sampled connections to path. Returns 0 on success.
+ */
+int OpenCapture(const char * path, int sample) {
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (trace_fd < 0) {
+        cerr << "capture: open() failed for " << path << endl;
+        return -1;
+    }
+    struct stat sb;
+    if (fstat(trace_fd, &sb) == 0 && sb.st_size == 0) {
+        if (write(trace_fd, TRACE_MAGIC, 8) != 8) {
+            cerr << "capture: write() failed for " << path << endl;
+        }
+    }
+    trace_sample = sample > 0 ? sample : 1;
+    return 0;
+}
+
+
+static void WriteRecord(uint32_t type, uint64_t conn, const char * buffer, size_t len,
+                        uint32_t status, uint64_t bytes) {
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct trace_rec rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.type = type;
+    rec.len = len;
+    rec.conn = conn;
+    rec.usec = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    rec.status = status;
+    rec.bytes = bytes;
+
+    struct iovec iov[2];
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = (void *)buffer;
+    iov[1].iov_len = len;
+    if (writev(trace_fd, iov, len > 0 ? 2 : 1) != (ssize_t)(sizeof(rec) + len)) {
+        cerr << "capture: writev() failed, disabling capture" << endl;
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
+
+
+/*
+ *  Decide whether to capture a newly accepted connection.
+ *  Returns its trace id, or 0 if it isn't sampled.
+ */
+uint64_t CaptureOpen() {
+
+    if (trace_fd < 0 || num_conns++ % trace_sample != 0) {
+        return 0;
+    }
+    uint64_t conn = ((uint64_t)getpid() << 32) | (num_conns & 0xffffffff);
+    WriteRecord(TRACE_OPEN, conn, NULL, 0, 0, 0);
+    return conn;
+}
+
+
+void CaptureData(uint64_t conn, const char * buffer, size_t len) {
+
+    if (conn != 0 && trace_fd >= 0) {
+        WriteRecord(TRACE_DATA, conn, buffer, len, 0, 0);
+    }
+}
+
+
+void CaptureResponse(uint64_t conn, int status, uint64_t bytes) {
+
+    if (conn != 0 && trace_fd >= 0) {
+        WriteRecord(TRACE_RESPONSE, conn, NULL, 0, status, bytes);
+    }
+}
+
+
+void CaptureClose(uint64_t conn) {
+
+    if (conn != 0 && trace_fd >= 0) {
+        WriteRecord(TRACE_CLOSE, conn, NULL, 0, 0, 0);
+    }
+}
+
+
+/*
+ *  Size of the chunked body starting at pos of in, chunk framing and
+ *  trailer included, or 0 if it is not all there yet.
+ */
+static size_t ChunkedSize(const string & in, size_t pos) {
+
+    size_t start = pos;
+    uint64_t chunk;
+    do {
+        size_t eol = in.find("\r\n", pos);
+        if (eol == string::npos) {
+            return 0;
+        }
+        chunk = strtoull(in.c_str() + pos, NULL, 16);
+        pos = eol + 2;
+        if (chunk > 0) {
+            pos += chunk + 2;
+            if (pos > in.size()) {
+                return 0;
+            }
+        }
+    } while (chunk > 0);
+    // trailer fields, if any, then an empty line
+    while (1) {
+        size_t eol = in.find("\r\n", pos);
+        if (eol == string::npos) {
+            return 0;
+        }
+        if (eol == pos) {
+            return eol + 2 - start;
+        }
+        pos = eol + 2;
+    }
+}
+
+
+/*
+ *  Size of the response at the start of buffer, as TRACE_RESPONSE counts
+ *  it: header and body, which is either Content-Length bytes or chunked
+ *  (as big listings are sent). Returns 0 until the whole response is in;
+ *  status gets its status code.
+ */
+size_t TraceResponseSize(const char * buffer, size_t len, uint32_t * status) {
+
+    string in(buffer, len);
+    size_t end = in.find("\r\n\r\n");
+    if (end == string::npos) {
+        return 0;
+    }
+    string lower = in.substr(0, end + 4);
+    transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    uint64_t body = 0;
+    size_t cl = lower.find("\r\ncontent-length:");
+    size_t te = lower.find("\r\ntransfer-encoding:");
+    if (te != string::npos && lower.find("chunked", te) < lower.find("\r\n", te + 2)) {
+        body = ChunkedSize(in, end + 4);
+        if (body == 0) {
+            return 0;
+        }
+    }
+    else if (cl != string::npos) {
+        body = strtoull(lower.c_str() + cl + 17, NULL, 10);
+    }
+    if (len < end + 4 + body) {
+        return 0;
+    }
+    *status = end > 12 ? atoi(buffer + 9) : 0;
+    return end + 4 + body;
+}
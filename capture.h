@@ -0,0 +1,39 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ *  Traffic capture for later replay (see replay.cpp). A trace file is
+ *  TRACE_MAGIC followed by records, each a trace_rec optionally followed by
+ *  len bytes of payload. Connections are sampled 1 in N at accept time;
+ *  for a sampled connection every received message, every response's
+ *  status and size, and the close are recorded. Records are appended with
+ *  one write() each, so prefork workers can share a trace file.
+ */
+#define TRACE_MAGIC     "HTTPDTR1"
+
+#define TRACE_OPEN      1
+#define TRACE_DATA      2       // bytes received from the client
+#define TRACE_RESPONSE  3       // status and total bytes we sent back
+#define TRACE_CLOSE     4
+
+typedef struct trace_rec {
+    uint32_t type;
+    uint32_t len;               // payload bytes following the record
+    uint64_t conn;              // pid << 32 | per-process counter
+    uint64_t usec;              // wall clock time
+    uint32_t status;
+    uint32_t pad;
+    uint64_t bytes;
+} trace_rec;
+
+int OpenCapture(const char * path, int sample);
+uint64_t CaptureOpen();
+void CaptureData(uint64_t conn, const char * buffer, size_t len);
+void CaptureResponse(uint64_t conn, int status, uint64_t bytes);
+void CaptureClose(uint64_t conn);
+size_t TraceResponseSize(const char * buffer, size_t len, uint32_t * status);
+
+#endif // CAPTURE_H
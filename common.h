@@ -3,7 +3,6 @@
 #define SOCK_TIMEOUT    5
 #define MAX_HEADER_SIZE 512
 #define KV_SIZE         10
-#define MAXPENDING      5
 #define BUFSIZE         512
 
 using namespace std;
@@ -27,11 +26,14 @@ typedef struct http_req {
 } http_req;
 
 typedef struct http_res {
-    string http_version;
-    string response;
-    string server;
-    string last_modified;
-    string content_type;
-    int content_length;
+    int code;
+    int close;
+    time_t last_modified;       // -1 for no Last-Modified field
+    const char * content_type;
+    const char * content_encoding;
+    const char * vary;          // Vary field, NULL for none
+    off_t content_length;
+    int chunked;                // no length, body goes out in chunks
     string fname;
+    string location;            // redirect target
 } http_res;
@@ -0,0 +1,414 @@
+#include "httpd.h"
+#include "dirlist.h"
+#include <map>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+
+/*
+ *  Rendering and caching of directory listings, see dirlist.h. Each
+ *  process has its own cache and inotify instance; pending events are
+ *  read before every lookup, and any event on a watched directory drops
+ *  its listings. A directory is watched from the time its listing is
+ *  first rendered until it changes or its last listing is evicted.
+ */
+
+using namespace std;
+
+// anything that changes what a listing shows
+#define DIRLIST_EVENTS  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                         IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF)
+
+typedef struct cached_listing {
+    int fd;
+    off_t length;
+    int wd;
+} cached_listing;
+
+static map<string, struct cached_listing> listings;
+static int notify_fd = -1;
+static pid_t notify_pid = 0;
+
+
+/*
+ *  Set up inotify for this process. A prefork worker inherits the parent's
+ *  instance, whose events only one process would get, so it starts over.
+ */
+static int InitNotify() {
+
+    if (notify_fd >= 0 && notify_pid == getpid()) {
+        return 0;
+    }
+    if (notify_fd >= 0) {
+        close(notify_fd);
+        for (map<string, struct cached_listing>::iterator it = listings.begin();
+             it != listings.end(); ++it) {
+            close(it->second.fd);
+        }
+        listings.clear();
+    }
+    notify_pid = getpid();
+    notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (notify_fd < 0) {
+        cerr << "inotify_init1() failed, listings are not cached" << endl;
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ *  Remove watch wd unless a cached listing still depends on it.
+ */
+static void ReleaseWatch(int wd) {
+
+    if (wd < 0) {
+        return;
+    }
+    for (map<string, struct cached_listing>::iterator it = listings.begin();
+         it != listings.end(); ++it) {
+        if (it->second.wd == wd) {
+            return;
+        }
+    }
+    inotify_rm_watch(notify_fd, wd);
+}
+
+
+static void DropListings(int wd) {
+
+    map<string, struct cached_listing>::iterator it = listings.begin();
+    while (it != listings.end()) {
+        if (wd < 0 || it->second.wd == wd) {
+            close(it->second.fd);
+            it = listings.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+}
+
+
+/*
+ *  Drop the listings of every directory inotify has reported a change in.
+ *  Returns whether anything happened to watch wd.
+ */
+static int ReadNotify(int wd) {
+
+    alignas(struct inotify_event) char buffer[4096];
+    int changed = 0;
+    while (1) {
+        ssize_t n = read(notify_fd, buffer, sizeof(buffer));
+        if (n <= 0) {
+            // EAGAIN, nothing more queued
+            return changed;
+        }
+        char * p = buffer;
+        while (p < buffer + n) {
+            const struct inotify_event * ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // events were lost, so any listing may be stale
+                DropListings(-1);
+                changed = 1;
+            }
+            else {
+                // it is watched again when it is next listed
+                DropListings(ev->wd);
+                if (!(ev->mask & IN_IGNORED)) {
+                    inotify_rm_watch(notify_fd, ev->wd);
+                }
+                changed |= ev->wd == wd;
+            }
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+
+
+/*
+ *  Append to the listing's memfd.
+ */
+static int AppendListing(struct dir_listing * l, const string & out) {
+
+    size_t pos = 0;
+    while (pos < out.size()) {
+        ssize_t n = write(l->fd, out.data() + pos, out.size() - pos);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            cerr << "write() failed for listing" << endl;
+            return -1;
+        }
+        pos += n;
+    }
+    l->length += out.size();
+    return 0;
+}
+
+
+static void AppendHtml(string & out, const char * s) {
+
+    for (; *s != '\0'; s++) {
+        switch (*s) {
+            case '&':   out += "&amp;"; break;
+            case '<':   out += "&lt;"; break;
+            case '>':   out += "&gt;"; break;
+            case '"':   out += "&quot;"; break;
+            case '\'':  out += "&#39;"; break;
+            default:    out += *s;
+        }
+    }
+}
+
+
+/*
+ *  Percent-encode a name for use as a relative link.
+ */
+static void AppendHref(string & out, const char * s) {
+
+    static const char hex[] = "0123456789ABCDEF";
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (isalnum(c) || strchr("-._~!$()*,;=@", c) != NULL) {
+            out += c;
+        }
+        else {
+            out += '%';
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+    }
+}
+
+
+static void AppendJson(string & out, const char * s) {
+
+    static const char hex[] = "0123456789abcdef";
+    out += '"';
+    for (; *s != '\0'; s++) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if (c < 0x20) {
+            out += "\\u00";
+            out += hex[c >> 4];
+            out += hex[c & 15];
+        }
+        else {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+
+static void RenderEntry(struct dir_listing * l, const char * name, struct stat * sb,
+                        string & out) {
+
+    int dir = S_ISDIR(sb->st_mode);
+    if (l->format == DIRLIST_JSON) {
+        out += l->entries == 0 ? "\n" : ",\n";
+        out += "{\"name\":";
+        AppendJson(out, name);
+        out += dir ? ",\"type\":\"dir\"" : ",\"type\":\"file\"";
+        out += ",\"size\":" + to_string((long long)sb->st_size);
+        out += ",\"mtime\":" + to_string((long long)sb->st_mtime) + "}";
+    }
+    else {
+        out += "<li><a href=\"";
+        AppendHref(out, name);
+        out += dir ? "/\">" : "\">";
+        AppendHtml(out, name);
+        out += dir ? "/</a></li>\n" : "</a> " + to_string((long long)sb->st_size) + "</li>\n";
+    }
+    l->entries++;
+}
+
+
+const char * ListingType(int format) {
+
+    return format == DIRLIST_JSON ? "application/json" : "text/html; charset=utf-8";
+}
+
+
+/*
+ *  Keep a finished listing, unless its directory changed while it was
+ *  being read. The fd now belongs to the cache.
+ */
+static void CacheListing(struct dir_listing * l) {
+
+    if (l->wd < 0 || ReadNotify(l->wd)) {
+        return;
+    }
+    if (listings.size() >= DIRLIST_CACHED) {
+        // no recency to go by; any victim will do
+        map<string, struct cached_listing>::iterator victim = listings.begin();
+        int wd = victim->second.wd;
+        close(victim->second.fd);
+        listings.erase(victim);
+        if (wd != l->wd) {
+            ReleaseWatch(wd);
+        }
+    }
+    struct cached_listing c = { l->fd, l->length, l->wd };
+    listings[l->key] = c;
+    l->own_fd = 0;
+}
+
+
+/*
+ *  Whether entry name of the listing is one CheckFile would serve; sb gets
+ *  what it stats to.
+ */
+static int Listable(struct dir_listing * l, const char * name, struct stat * sb) {
+
+    if (name[0] == '.' || fstatat(dirfd(l->dir), name, sb, AT_SYMLINK_NOFOLLOW) != 0) {
+        return 0;
+    }
+    if (S_ISLNK(sb->st_mode)) {
+        char target[PATH_MAX];
+        if (realpath((l->path + name).c_str(), target) == NULL ||
+            !UnderRoot(l->root, target) ||
+            stat(target, sb) != 0) {
+            return 0;
+        }
+    }
+    return (sb->st_mode & S_IROTH) != 0;
+}
+
+
+/*
+ *  Start on the listing of directory path, served at uri from doc_root.
+ *  A cached listing comes back done; otherwise the header and the first
+ *  batch of entries are rendered. Returns 0 on success.
+ */
+int OpenListing(string doc_root, string path, string uri, int format, struct dir_listing * l) {
+
+    l->fd = -1;
+    l->own_fd = 0;
+    l->length = 0;
+    l->done = 0;
+    l->format = format;
+    l->entries = 0;
+    l->wd = -1;
+    l->dir = NULL;
+    l->root = doc_root;
+    l->path = path;
+    l->key = string(1, '0' + format) + path;
+
+    if (InitNotify() == 0) {
+        ReadNotify(-1);
+        map<string, struct cached_listing>::iterator it = listings.find(l->key);
+        if (it != listings.end()) {
+            l->fd = it->second.fd;
+            l->length = it->second.length;
+            l->done = 1;
+            return 0;
+        }
+        // watch before reading, so a change while we read is not missed
+        l->wd = inotify_add_watch(notify_fd, path.c_str(), DIRLIST_EVENTS | IN_ONLYDIR);
+        if (l->wd < 0) {
+            cerr << "inotify_add_watch() failed for " << path << endl;
+        }
+    }
+
+    l->dir = opendir(path.c_str());
+    l->fd = memfd_create("dirlist", MFD_CLOEXEC);
+    l->own_fd = l->fd >= 0;
+    if (l->dir == NULL || l->fd < 0) {
+        cerr << "cannot list " << path << endl;
+        CloseListing(l);
+        return -1;
+    }
+
+    string out;
+    if (format == DIRLIST_JSON) {
+        out = "[";
+    }
+    else {
+        out = "<!DOCTYPE html>\n<html>\n<head><meta charset=\"utf-8\"><title>Index of ";
+        AppendHtml(out, uri.c_str());
+        out += "</title></head>\n<body>\n<h1>Index of ";
+        AppendHtml(out, uri.c_str());
+        out += "</h1>\n<ul>\n";
+        if (uri != "/") {
+            out += "<li><a href=\"../\">../</a></li>\n";
+        }
+    }
+    if (AppendListing(l, out) != 0) {
+        CloseListing(l);
+        return -1;
+    }
+    return NextListing(l);
+}
+
+
+/*
+ *  Render the next DIRLIST_BATCH entries, or the footer once the
+ *  directory is exhausted, appending them to l->fd. Returns 0 on success.
+ */
+int NextListing(struct dir_listing * l) {
+
+    if (l->done) {
+        return 0;
+    }
+    string out;
+    int n = 0;
+    int end = 0;
+    while (n < DIRLIST_BATCH) {
+        errno = 0;
+        struct dirent * de = readdir(l->dir);
+        if (de == NULL) {
+            if (errno != 0) {
+                cerr << "readdir() failed" << endl;
+                return -1;
+            }
+            end = 1;
+            break;
+        }
+        struct stat sb;
+        if (!Listable(l, de->d_name, &sb)) {
+            continue;
+        }
+        RenderEntry(l, de->d_name, &sb, out);
+        n++;
+    }
+    if (end) {
+        out += l->format == DIRLIST_JSON ? "\n]\n" : "</ul>\n</body>\n</html>\n";
+    }
+    if (AppendListing(l, out) != 0) {
+        return -1;
+    }
+    if (end) {
+        closedir(l->dir);
+        l->dir = NULL;
+        l->done = 1;
+        CacheListing(l);
+    }
+    return 0;
+}
+
+
+/*
+ *  Let go of a listing, finished or not.
+ */
+void CloseListing(struct dir_listing * l) {
+
+    if (l->dir != NULL) {
+        closedir(l->dir);
+        l->dir = NULL;
+    }
+    // unless the cache took it, nothing needs the watch any more
+    if (l->wd >= 0 && (l->own_fd || !l->done)) {
+        ReleaseWatch(l->wd);
+    }
+    if (l->own_fd) {
+        close(l->fd);
+        l->own_fd = 0;
+    }
+    l->fd = -1;
+    l->wd = -1;
+}
@@ -0,0 +1,47 @@
+#ifndef DIRLIST_H
+#define DIRLIST_H
+
+#include <dirent.h>
+#include <sys/types.h>
+#include <string>
+
+using namespace std;
+
+/*
+ *  Listings of directories that have no index.html, as HTML or JSON.
+ *  A listing is rendered into a memfd and kept, keyed by directory and
+ *  format, until inotify reports a change in the directory, so a repeat
+ *  hit is sendfile() from the memfd like any other body. Rendering goes
+ *  DIRLIST_BATCH entries at a time: a listing that fits in one batch is
+ *  complete before its header goes out, a bigger one can be sent (chunked)
+ *  as each batch is appended, so the first bytes go out without waiting
+ *  for the whole directory. The memfd itself lives in RAM, cached or not.
+ *  Entries are in directory order, and only those CheckFile would serve
+ *  are shown: no dotfiles, nothing that is not world readable and no
+ *  symlinks leading out of the document root.
+ */
+#define DIRLIST_HTML    0
+#define DIRLIST_JSON    1
+#define DIRLIST_BATCH   1024    // entries rendered per step
+#define DIRLIST_CACHED  64      // listings kept per process
+
+typedef struct dir_listing {
+    int fd;             // memfd with the listing, valid until the next OpenListing
+    int own_fd;         // not handed to the cache yet
+    off_t length;       // bytes rendered so far
+    int done;           // all of it is in fd
+    int format;
+    int entries;        // entries rendered so far
+    int wd;             // inotify watch on the directory, -1 for none
+    DIR * dir;          // NULL once done
+    string root;        // document root, which symlinks must stay under
+    string path;        // the directory, with a trailing '/'
+    string key;         // cache key
+} dir_listing;
+
+const char * ListingType(int format);
+int OpenListing(string doc_root, string path, string uri, int format, struct dir_listing * l);
+int NextListing(struct dir_listing * l);
+void CloseListing(struct dir_listing * l);
+
+#endif // DIRLIST_H
@@ -0,0 +1,181 @@
+#include "httpd.h"
+#include "flight.h"
+#include <time.h>
+#include <sys/time.h>
+
+using namespace std;
+
+static struct flight_rec ring[FLIGHT_RING];
+static uint64_t num_recorded = 0;
+// the request being served, NULL when none or the recorder is off
+static struct flight_rec * cur = NULL;
+static int slow_fd = -1;
+static uint64_t slow_ns = 0;
+
+static const char * stage_names[FLIGHT_STAGES] = {
+    "recv", "parse", "resolve", "header", "body", "done"
+};
+static const char * syscall_names[FLIGHT_SYSCALLS] = {
+    "recv", "send", "sendfile", "open", "stat"
+};
+
+
+static uint64_t MonotonicNs() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/*
+ *  Start recording requests, appending those that take slow_ms or more
+ *  to path. Returns 0 on success.
+ */
+int OpenFlightRecorder(const char * path, int slow_ms) {
+
+    CloseFlightRecorder();
+    slow_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (slow_fd < 0) {
+        cerr << "flight: open() failed for " << path << endl;
+        return -1;
+    }
+    slow_ns = (uint64_t)slow_ms * 1000000;
+    num_recorded = 0;
+    return 0;
+}
+
+
+void CloseFlightRecorder() {
+
+    if (slow_fd >= 0) {
+        close(slow_fd);
+    }
+    slow_fd = -1;
+    cur = NULL;
+}
+
+
+/*
+ *  The first bytes of a request on fd are in. A request the client
+ *  abandoned before FlightEnd is overwritten.
+ */
+void FlightBegin(int fd) {
+
+    if (slow_fd < 0) {
+        return;
+    }
+    cur = &ring[num_recorded % FLIGHT_RING];
+    memset(cur, 0, sizeof(*cur));
+    cur->fd = fd;
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    cur->start_us = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+    cur->stage[FLIGHT_RECV] = MonotonicNs();
+}
+
+
+void FlightRequest(const char * method, const char * uri) {
+
+    if (cur != NULL) {
+        snprintf(cur->method, sizeof(cur->method), "%s", method);
+        snprintf(cur->uri, sizeof(cur->uri), "%s", uri);
+    }
+}
+
+
+void FlightStage(int stage) {
+
+    if (cur != NULL) {
+        cur->stage[stage] = MonotonicNs();
+    }
+}
+
+
+void FlightSyscall(int kind) {
+
+    if (cur != NULL) {
+        cur->syscalls[kind]++;
+    }
+}
+
+
+/*
+ *  One line per request: wall clock start, fd, request, status, size and
+ *  total time.
+ */
+static size_t FormatSummary(char * buffer, size_t size, const struct flight_rec * r) {
+
+    time_t secs = r->start_us / 1000000;
+    struct tm tm;
+    localtime_r(&secs, &tm);
+    int n = snprintf(buffer, size, "%02d:%02d:%02d.%06llu fd %d %s %s %d %llu bytes %.3f ms\n",
+                     tm.tm_hour, tm.tm_min, tm.tm_sec, (unsigned long long)(r->start_us % 1000000),
+                     r->fd, r->method, r->uri, r->code, (unsigned long long)r->bytes,
+                     (r->stage[FLIGHT_DONE] - r->stage[FLIGHT_RECV]) / 1e6);
+    return n < 0 ? 0 : min((size_t)n, size);
+}
+
+
+/*
+ *  Append r, the request just finished, to the slow log along with the
+ *  requests before it.
+ */
+static void DumpSlow(const struct flight_rec * r) {
+
+    char buffer[8192];
+    size_t size = sizeof(buffer);
+    size_t pos = 0;
+
+    int n = snprintf(buffer, size, "slow request in pid %d: ", (int)getpid());
+    pos += n < 0 ? 0 : n;
+    pos += FormatSummary(buffer + pos, size - pos, r);
+    pos += snprintf(buffer + pos, size - pos, "  stages (ms in):");
+    for (int i = FLIGHT_PARSE; i < FLIGHT_STAGES && pos < size; i++) {
+        if (r->stage[i] != 0) {
+            pos += snprintf(buffer + pos, size - pos, " %s %.3f", stage_names[i],
+                            (r->stage[i] - r->stage[FLIGHT_RECV]) / 1e6);
+        }
+    }
+    if (pos < size) {
+        pos += snprintf(buffer + pos, size - pos, "\n  syscalls:");
+    }
+    for (int i = 0; i < FLIGHT_SYSCALLS && pos < size; i++) {
+        pos += snprintf(buffer + pos, size - pos, " %s %u", syscall_names[i], r->syscalls[i]);
+    }
+    if (pos < size) {
+        pos += snprintf(buffer + pos, size - pos, "\n  before it:\n");
+    }
+    // r is num_recorded - 1; the ones before it that are still in the ring
+    uint64_t first = num_recorded > FLIGHT_CONTEXT + 1 ? num_recorded - FLIGHT_CONTEXT - 1 : 0;
+    for (uint64_t i = first; i + 1 < num_recorded && pos + 2 < size; i++) {
+        pos += snprintf(buffer + pos, size - pos, "  ");
+        pos += FormatSummary(buffer + pos, size - pos, &ring[i % FLIGHT_RING]);
+    }
+    if (pos < size) {
+        pos += snprintf(buffer + pos, size - pos, "\n");
+    }
+    pos = min(pos, size);
+    if (write(slow_fd, buffer, pos) != (ssize_t)pos) {
+        cerr << "flight: write() failed" << endl;
+    }
+}
+
+
+/*
+ *  The response to the current request is out.
+ */
+void FlightEnd(int code, uint64_t bytes) {
+
+    if (cur == NULL) {
+        return;
+    }
+    cur->stage[FLIGHT_DONE] = MonotonicNs();
+    cur->code = code;
+    cur->bytes = bytes;
+    num_recorded++;
+    if (cur->stage[FLIGHT_DONE] - cur->stage[FLIGHT_RECV] >= slow_ns) {
+        DumpSlow(cur);
+    }
+    cur = NULL;
+}
@@ -0,0 +1,79 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ *  Per-request tracing. PROBE*() are USDT probes of provider "httpd" when
+ *  built with HTTPD_USDT (which needs sys/sdt.h; the Makefile sets it if
+ *  the header is there, CMake has an option): a nop in the code and an
+ *  ELF note that perf or bpftrace can attach to, so they cost nothing
+ *  while nobody is. Without it they compile away. The request path has
+ *  an entry and a return probe, name__entry and name__return, around
+ *  each step.
+ *
+ *  The flight recorder keeps the last FLIGHT_RING requests of a process
+ *  with the time each stage was entered and the syscalls made per kind.
+ *  A request slower than the threshold is appended to the slow log with
+ *  one write(), followed by a line for each of the FLIGHT_CONTEXT
+ *  requests before it.
+ */
+#ifdef HTTPD_USDT
+#include <sys/sdt.h>
+#endif
+
+#ifdef HTTPD_USDT
+#define PROBE(name)             DTRACE_PROBE(httpd, name)
+#define PROBE1(name, a)         DTRACE_PROBE1(httpd, name, a)
+#define PROBE2(name, a, b)      DTRACE_PROBE2(httpd, name, a, b)
+#define PROBE3(name, a, b, c)   DTRACE_PROBE3(httpd, name, a, b, c)
+#else
+#define PROBE(name)             do { } while (0)
+#define PROBE1(name, a)         do { (void)(a); } while (0)
+#define PROBE2(name, a, b)      do { (void)(a); (void)(b); } while (0)
+#define PROBE3(name, a, b, c)   do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+#define FLIGHT_RING     256
+#define FLIGHT_CONTEXT  16
+#define FLIGHT_LOG      "httpd-slow.log"
+#define FLIGHT_URI      128
+
+// stages, in the order a request goes through them
+#define FLIGHT_RECV     0       // first bytes of the request arrived
+#define FLIGHT_PARSE    1
+#define FLIGHT_RESOLVE  2       // CheckFile or the archive lookup
+#define FLIGHT_HEADER   3
+#define FLIGHT_BODY     4
+#define FLIGHT_DONE     5
+#define FLIGHT_STAGES   6
+
+// syscalls counted per request
+#define FLIGHT_SYS_RECV     0
+#define FLIGHT_SYS_SEND     1
+#define FLIGHT_SYS_SENDFILE 2
+#define FLIGHT_SYS_OPEN     3
+#define FLIGHT_SYS_STAT     4   // stat() and friends, realpath() counts once
+#define FLIGHT_SYSCALLS     5
+
+typedef struct flight_rec {
+    uint64_t start_us;                  // wall clock, for the log
+    uint64_t stage[FLIGHT_STAGES];      // CLOCK_MONOTONIC ns, 0 if skipped
+    uint32_t syscalls[FLIGHT_SYSCALLS];
+    int fd;
+    int code;
+    uint64_t bytes;
+    char method[8];
+    char uri[FLIGHT_URI];
+} flight_rec;
+
+int OpenFlightRecorder(const char * path, int slow_ms);
+void CloseFlightRecorder();
+void FlightBegin(int fd);
+void FlightRequest(const char * method, const char * uri);
+void FlightStage(int stage);
+void FlightSyscall(int kind);
+void FlightEnd(int code, uint64_t bytes);
+
+#endif // FLIGHT_H
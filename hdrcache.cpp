@@ -0,0 +1,138 @@
+#include "httpd.h"
+#include "hdrcache.h"
+
+using namespace std;
+
+#define SPAN(s) { s, sizeof(s) - 1 }
+
+typedef struct date_cache {
+    time_t now;
+    char line[HDR_DATE_LEN + 9];        // "Date: " + date + "\r\n"
+} date_cache;
+
+typedef struct lm_cache {
+    time_t mtime[HDR_LM_SLOTS];
+    char line[HDR_LM_SLOTS][HDR_DATE_LEN + 18];   // "Last-Modified: " + date + "\r\n"
+} lm_cache;
+
+static const struct hdr_span status_ok = SPAN(SERV_VER " 200 OK\r\n");
+static const struct hdr_span status_moved = SPAN(SERV_VER " 301 Moved Permanently\r\n");
+static const struct hdr_span status_cerror = SPAN(SERV_VER " 400 Client Error\r\n");
+static const struct hdr_span status_forbidden = SPAN(SERV_VER " 403 Forbidden\r\n");
+static const struct hdr_span status_notfound = SPAN(SERV_VER " 404 Not Found\r\n");
+static const struct hdr_span status_serror = SPAN(SERV_VER " 500 Server Error\r\n");
+static const struct hdr_span server = SPAN("Server: " SERV_NAME "\r\n");
+static const struct hdr_span conn_close = SPAN("Connection: close\r\n");
+static const struct hdr_span conn_keepalive = SPAN("Connection: keep-alive\r\n");
+
+static thread_local struct date_cache date;
+static thread_local struct lm_cache last_modified;
+
+static const char days[7][4] = {
+    "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"
+};
+static const char months[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+
+struct hdr_span StatusLine(int response_code) {
+
+    switch (response_code) {
+        case RESP_OK:           return status_ok;
+        case RESP_MOVED:        return status_moved;
+        case RESP_CERROR:       return status_cerror;
+        case RESP_FORBIDDEN:    return status_forbidden;
+        case RESP_NOTFOUND:     return status_notfound;
+        default:                return status_serror;
+    }
+}
+
+
+struct hdr_span ServerHeader() {
+    return server;
+}
+
+
+struct hdr_span ConnectionHeader(int close) {
+    return close ? conn_close : conn_keepalive;
+}
+
+
+/*
+ *  Write t as an RFC 7231 IMF-fixdate (always HDR_DATE_LEN bytes, no
+ *  terminator). Done by hand because strftime() depends on the locale.
+ */
+size_t FormatHttpDate(time_t t, char * buffer) {
+
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    char * p = buffer;
+    memcpy(p, days[tm.tm_wday], 3);
+    p += 3;
+    *p++ = ',';
+    *p++ = ' ';
+    *p++ = '0' + tm.tm_mday / 10;
+    *p++ = '0' + tm.tm_mday % 10;
+    *p++ = ' ';
+    memcpy(p, months[tm.tm_mon], 3);
+    p += 3;
+    *p++ = ' ';
+    int year = tm.tm_year + 1900;
+    *p++ = '0' + year / 1000 % 10;
+    *p++ = '0' + year / 100 % 10;
+    *p++ = '0' + year / 10 % 10;
+    *p++ = '0' + year % 10;
+    *p++ = ' ';
+    *p++ = '0' + tm.tm_hour / 10;
+    *p++ = '0' + tm.tm_hour % 10;
+    *p++ = ':';
+    *p++ = '0' + tm.tm_min / 10;
+    *p++ = '0' + tm.tm_min % 10;
+    *p++ = ':';
+    *p++ = '0' + tm.tm_sec / 10;
+    *p++ = '0' + tm.tm_sec % 10;
+    memcpy(p, " GMT", 4);
+    return HDR_DATE_LEN;
+}
+
+
+/*
+ *  "Date: ...\r\n" for the current second. The coarse clock is a vDSO read
+ *  with no syscall, so checking it per response is cheaper than arming a
+ *  timer per thread; the string itself is only rebuilt when the second
+ *  ticks over.
+ */
+struct hdr_span DateHeader() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec != date.now || date.line[0] == '\0') {
+        memcpy(date.line, "Date: ", 6);
+        FormatHttpDate(ts.tv_sec, date.line + 6);
+        memcpy(date.line + 6 + HDR_DATE_LEN, "\r\n", 2);
+        date.now = ts.tv_sec;
+    }
+    struct hdr_span span = { date.line, HDR_DATE_LEN + 8 };
+    return span;
+}
+
+
+/*
+ *  "Last-Modified: ...\r\n" for mtime, memoized in a small direct-mapped
+ *  table since the same few files tend to get requested over and over.
+ */
+struct hdr_span LastModifiedHeader(time_t mtime) {
+
+    unsigned slot = (unsigned long)mtime % HDR_LM_SLOTS;
+    char * line = last_modified.line[slot];
+    if (last_modified.mtime[slot] != mtime || line[0] == '\0') {
+        memcpy(line, "Last-Modified: ", 15);
+        FormatHttpDate(mtime, line + 15);
+        memcpy(line + 15 + HDR_DATE_LEN, "\r\n", 2);
+        last_modified.mtime[slot] = mtime;
+    }
+    struct hdr_span span = { line, HDR_DATE_LEN + 17 };
+    return span;
+}
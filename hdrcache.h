@@ -0,0 +1,29 @@
+#ifndef HDRCACHE_H
+#define HDRCACHE_H
+
+#include <stddef.h>
+#include <time.h>
+
+/*
+ *  Preformatted response header fragments. Status lines and fixed fields
+ *  are static byte spans; Date and Last-Modified are formatted at most once
+ *  per second / per mtime and kept in a per-thread cache, so building a
+ *  response header is just a few memcpy()s.
+ */
+#define HDR_MAX         1024
+#define HDR_DATE_LEN    29      // "Sun, 06 Nov 1994 08:49:37 GMT"
+#define HDR_LM_SLOTS    64
+
+typedef struct hdr_span {
+    const char * data;
+    size_t len;
+} hdr_span;
+
+struct hdr_span StatusLine(int response_code);
+struct hdr_span ServerHeader();
+struct hdr_span ConnectionHeader(int close);
+struct hdr_span DateHeader();
+struct hdr_span LastModifiedHeader(time_t mtime);
+size_t FormatHttpDate(time_t t, char * buffer);
+
+#endif // HDRCACHE_H
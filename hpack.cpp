@@ -0,0 +1,495 @@
+#include "hpack.h"
+#include <string.h>
+
+using namespace std;
+
+typedef struct static_entry {
+    const char * name;
+    const char * value;
+} static_entry;
+
+// RFC 7541 appendix A, index 1 is the first entry
+static const struct static_entry static_table[HPACK_STATIC_ENTRIES] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// RFC 7541 appendix B, symbol 256 is EOS
+static const uint32_t huffman_codes[257] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5, 0xfffffe6, 0xfffffe7,
+    0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9, 0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec,
+    0xfffffed, 0xfffffee, 0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9, 0xffffffa, 0xffffffb,
+    0x14, 0x3f8, 0x3f9, 0xffa, 0x1ff9, 0x15, 0xf8, 0x7fa,
+    0x3fa, 0x3fb, 0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b, 0x1c, 0x1d,
+    0x1e, 0x1f, 0x5c, 0xfb, 0x7ffc, 0x20, 0xffb, 0x3fc,
+    0x1ffa, 0x21, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a,
+    0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72,
+    0xfc, 0x73, 0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5, 0x25, 0x26,
+    0x27, 0x6, 0x74, 0x75, 0x28, 0x29, 0x2a, 0x7,
+    0x2b, 0x76, 0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd, 0x1ffd, 0xffffffc,
+    0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8, 0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9,
+    0x3fffd6, 0x7fffda, 0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1, 0x7fffe2, 0x7fffe3,
+    0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5, 0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef,
+    0x3fffda, 0x1fffdd, 0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf, 0x7fffeb, 0x7fffec,
+    0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2, 0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef,
+    0xfffea, 0x3fffe2, 0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2, 0x3fffe8, 0x1ffffec,
+    0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde, 0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed,
+    0x7fff2, 0x1fffe3, 0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3, 0x7ffffe4, 0x7ffffe5,
+    0xfffec, 0xfffff3, 0xfffed, 0x1fffe6, 0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3,
+    0x3fffea, 0x3fffeb, 0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8, 0x7ffffe9, 0x7ffffea,
+    0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed, 0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+    0x3fffffff,
+};
+
+static const uint8_t huffman_lens[257] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+    30,
+};
+
+// decoding tree over huffman_codes: children of internal nodes, leaves
+// stored as -(symbol + 1)
+static int16_t huffman_tree[256][2];
+static int huffman_built = 0;
+
+
+static void BuildHuffmanTree() {
+
+    int nodes = 1;
+    memset(huffman_tree, 0, sizeof(huffman_tree));
+    for (int sym = 0; sym < 257; sym++) {
+        int node = 0;
+        for (int bit = huffman_lens[sym] - 1; bit >= 0; bit--) {
+            int b = (huffman_codes[sym] >> bit) & 1;
+            if (bit == 0) {
+                huffman_tree[node][b] = -(sym + 1);
+            }
+            else {
+                if (huffman_tree[node][b] == 0) {
+                    huffman_tree[node][b] = nodes++;
+                }
+                node = huffman_tree[node][b];
+            }
+        }
+    }
+    huffman_built = 1;
+}
+
+
+/*
+ *  Appends the decoded string to out. Returns 0, or -1 if the input holds
+ *  EOS or isn't padded with (at most 7) one bits as the RFC requires.
+ */
+int HuffmanDecode(const uint8_t * data, size_t len, string & out) {
+
+    if (!huffman_built) {
+        BuildHuffmanTree();
+    }
+    int node = 0;
+    int depth = 0;              // bits into the current code
+    int ones = 1;               // ... and whether they were all ones
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int b = (data[i] >> bit) & 1;
+            int next = huffman_tree[node][b];
+            depth++;
+            ones &= b;
+            if (next < 0) {
+                if (next == -257) {
+                    return -1;
+                }
+                out.push_back((char)(-next - 1));
+                node = 0;
+                depth = 0;
+                ones = 1;
+            }
+            else {
+                node = next;
+            }
+        }
+    }
+    return depth <= 7 && ones ? 0 : -1;
+}
+
+
+size_t HuffmanLength(const string & in) {
+
+    size_t bits = 0;
+    for (size_t i = 0; i < in.size(); i++) {
+        bits += huffman_lens[(unsigned char)in[i]];
+    }
+    return (bits + 7) / 8;
+}
+
+
+void HuffmanEncode(const string & in, string & out) {
+
+    uint64_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < in.size(); i++) {
+        unsigned char c = in[i];
+        acc = (acc << huffman_lens[c]) | huffman_codes[c];
+        bits += huffman_lens[c];
+        while (bits >= 8) {
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    if (bits > 0) {
+        // pad with the most significant bits of EOS, i.e. ones
+        out.push_back((char)((acc << (8 - bits)) | (0xff >> bits)));
+    }
+}
+
+
+void HpackInit(struct hpack_table * table, size_t limit) {
+
+    table->entries.clear();
+    table->size = 0;
+    table->max_size = limit;
+    table->limit = limit;
+    table->size_update = 0;
+}
+
+
+static void Evict(struct hpack_table * table, size_t room) {
+
+    while (!table->entries.empty() && table->size + room > table->max_size) {
+        struct hpack_field & f = table->entries.back();
+        table->size -= f.name.size() + f.value.size() + HPACK_ENTRY_OVERHEAD;
+        table->entries.pop_back();
+    }
+}
+
+
+static void AddEntry(struct hpack_table * table, const string & name, const string & value) {
+
+    size_t size = name.size() + value.size() + HPACK_ENTRY_OVERHEAD;
+    Evict(table, size);
+    // an entry bigger than the whole table just empties it
+    if (size > table->max_size) {
+        return;
+    }
+    struct hpack_field f = { name, value };
+    table->entries.push_front(f);
+    table->size += size;
+}
+
+
+/*
+ *  The peer changed SETTINGS_HEADER_TABLE_SIZE: shrink our encoder table
+ *  to fit and tell the decoder on the other end in the next block.
+ */
+void HpackSetLimit(struct hpack_table * table, size_t limit) {
+
+    size_t max_size = limit < HPACK_TABLE_SIZE ? limit : HPACK_TABLE_SIZE;
+    table->limit = limit;
+    if (max_size != table->max_size) {
+        table->max_size = max_size;
+        table->size_update = 1;
+        Evict(table, 0);
+    }
+}
+
+
+/*
+ *  Integers with an n-bit prefix (RFC 7541 5.1). The first byte's high
+ *  bits are the caller's.
+ */
+static int DecodeInt(const uint8_t * data, size_t len, size_t * pos, int n, uint32_t * value) {
+
+    uint32_t max = (1 << n) - 1;
+    if (*pos >= len) {
+        return -1;
+    }
+    *value = data[(*pos)++] & max;
+    if (*value < max) {
+        return 0;
+    }
+    for (int shift = 0; shift <= 21; shift += 7) {
+        if (*pos >= len) {
+            return -1;
+        }
+        uint8_t b = data[(*pos)++];
+        *value += (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return 0;
+        }
+    }
+    // more than 28 bits is nothing a sane peer sends
+    return -1;
+}
+
+
+static void EncodeInt(string & out, uint8_t first, int n, uint32_t value) {
+
+    uint32_t max = (1 << n) - 1;
+    if (value < max) {
+        out.push_back((char)(first | value));
+        return;
+    }
+    out.push_back((char)(first | max));
+    value -= max;
+    while (value >= 0x80) {
+        out.push_back((char)(0x80 | (value & 0x7f)));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+
+static int DecodeString(const uint8_t * data, size_t len, size_t * pos, string & out) {
+
+    if (*pos >= len) {
+        return -1;
+    }
+    int huffman = data[*pos] & 0x80;
+    uint32_t slen;
+    if (DecodeInt(data, len, pos, 7, &slen) != 0 || slen > len - *pos) {
+        return -1;
+    }
+    out.clear();
+    if (huffman) {
+        if (HuffmanDecode(data + *pos, slen, out) != 0) {
+            return -1;
+        }
+    }
+    else {
+        out.assign((const char *)data + *pos, slen);
+    }
+    *pos += slen;
+    return 0;
+}
+
+
+static void EncodeString(string & out, const string & str) {
+
+    size_t hlen = HuffmanLength(str);
+    if (hlen < str.size()) {
+        EncodeInt(out, 0x80, 7, hlen);
+        HuffmanEncode(str, out);
+    }
+    else {
+        EncodeInt(out, 0x00, 7, str.size());
+        out.append(str);
+    }
+}
+
+
+/*
+ *  Look up index (1-based, static table first). Returns 0 on success.
+ */
+static int GetIndexed(struct hpack_table * table, uint32_t index, struct hpack_field * f) {
+
+    if (index == 0) {
+        return -1;
+    }
+    if (index <= HPACK_STATIC_ENTRIES) {
+        f->name = static_table[index - 1].name;
+        f->value = static_table[index - 1].value;
+        return 0;
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if (index >= table->entries.size()) {
+        return -1;
+    }
+    *f = table->entries[index];
+    return 0;
+}
+
+
+/*
+ *  Decode a complete header block into fields, updating the dynamic
+ *  table. Returns 0, or -1 on anything that is a COMPRESSION_ERROR.
+ */
+int HpackDecode(struct hpack_table * table, const uint8_t * data, size_t len,
+                vector<struct hpack_field> & fields) {
+
+    size_t pos = 0;
+    size_t total = 0;
+    int first = 1;
+    while (pos < len) {
+        uint8_t b = data[pos];
+        struct hpack_field f;
+        uint32_t index;
+        if (b & 0x80) {
+            // indexed field
+            if (DecodeInt(data, len, &pos, 7, &index) != 0 || GetIndexed(table, index, &f) != 0) {
+                return -1;
+            }
+        }
+        else if ((b & 0xe0) == 0x20) {
+            // dynamic table size update, only before the first field
+            if (!first || DecodeInt(data, len, &pos, 5, &index) != 0 || index > table->limit) {
+                return -1;
+            }
+            table->max_size = index;
+            Evict(table, 0);
+            continue;
+        }
+        else {
+            // literal; 01 adds it to the table, 0000 and 0001 don't
+            int incremental = (b & 0xc0) == 0x40;
+            if (DecodeInt(data, len, &pos, incremental ? 6 : 4, &index) != 0) {
+                return -1;
+            }
+            if (index != 0) {
+                if (GetIndexed(table, index, &f) != 0) {
+                    return -1;
+                }
+            }
+            else if (DecodeString(data, len, &pos, f.name) != 0) {
+                return -1;
+            }
+            if (DecodeString(data, len, &pos, f.value) != 0) {
+                return -1;
+            }
+            if (incremental) {
+                AddEntry(table, f.name, f.value);
+            }
+        }
+        first = 0;
+        total += f.name.size() + f.value.size() + HPACK_ENTRY_OVERHEAD;
+        if (total > HPACK_MAX_LIST) {
+            return -1;
+        }
+        fields.push_back(f);
+    }
+    return 0;
+}
+
+
+/*
+ *  Encode fields as one header block. Exact matches are sent as an index;
+ *  everything else is added to the table except Content-Length, which
+ *  rarely repeats and would only push useful entries out.
+ */
+void HpackEncode(struct hpack_table * table, const vector<struct hpack_field> & fields,
+                 string & out) {
+
+    if (table->size_update) {
+        EncodeInt(out, 0x20, 5, table->max_size);
+        table->size_update = 0;
+    }
+    for (size_t i = 0; i < fields.size(); i++) {
+        const struct hpack_field & f = fields[i];
+        uint32_t name_index = 0;
+        uint32_t index = 0;
+        for (uint32_t s = 0; s < HPACK_STATIC_ENTRIES && index == 0; s++) {
+            if (f.name == static_table[s].name) {
+                if (name_index == 0) {
+                    name_index = s + 1;
+                }
+                if (f.value == static_table[s].value) {
+                    index = s + 1;
+                }
+            }
+        }
+        for (size_t d = 0; d < table->entries.size() && index == 0; d++) {
+            if (f.name == table->entries[d].name) {
+                if (name_index == 0) {
+                    name_index = HPACK_STATIC_ENTRIES + 1 + d;
+                }
+                if (f.value == table->entries[d].value) {
+                    index = HPACK_STATIC_ENTRIES + 1 + d;
+                }
+            }
+        }
+        if (index != 0) {
+            EncodeInt(out, 0x80, 7, index);
+            continue;
+        }
+        int incremental = f.name != "content-length";
+        EncodeInt(out, incremental ? 0x40 : 0x00, incremental ? 6 : 4, name_index);
+        if (name_index == 0) {
+            EncodeString(out, f.name);
+        }
+        EncodeString(out, f.value);
+        if (incremental) {
+            AddEntry(table, f.name, f.value);
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+#include <deque>
+
+using namespace std;
+
+/*
+ *  HPACK header compression for HTTP/2 (RFC 7541). Each direction of a
+ *  connection has its own dynamic table: the decoder mirrors the one the
+ *  client's encoder keeps, the encoder keeps ours. New entries go in at
+ *  the front and old ones are evicted from the back while the table's
+ *  size (name + value + 32 bytes per entry) is over max_size.
+ */
+#define HPACK_TABLE_SIZE        4096    // what we allow the client's table to grow to
+#define HPACK_ENTRY_OVERHEAD    32
+#define HPACK_STATIC_ENTRIES    61
+#define HPACK_MAX_LIST          65536   // decoded bytes per header block
+
+typedef struct hpack_field {
+    string name;
+    string value;
+} hpack_field;
+
+typedef struct hpack_table {
+    deque<struct hpack_field> entries;
+    size_t size;
+    size_t max_size;            // current limit, moved by size updates
+    size_t limit;               // SETTINGS_HEADER_TABLE_SIZE max_size must stay under
+    int size_update;            // encoder: announce max_size in the next block
+} hpack_table;
+
+void HpackInit(struct hpack_table * table, size_t limit);
+void HpackSetLimit(struct hpack_table * table, size_t limit);
+int HpackDecode(struct hpack_table * table, const uint8_t * data, size_t len,
+                vector<struct hpack_field> & fields);
+void HpackEncode(struct hpack_table * table, const vector<struct hpack_field> & fields,
+                 string & out);
+int HuffmanDecode(const uint8_t * data, size_t len, string & out);
+void HuffmanEncode(const string & in, string & out);
+size_t HuffmanLength(const string & in);
+
+#endif // HPACK_H
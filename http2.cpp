@@ -0,0 +1,858 @@
+#include "httpd.h"
+#include "http2.h"
+#include "hpack.h"
+#include "hdrcache.h"
+#include "prefork.h"
+#include "tls.h"
+#include "upgrade.h"
+#include <map>
+#include <poll.h>
+#include <strings.h>
+#include <netinet/tcp.h>
+
+using namespace std;
+
+typedef struct h2_frame {
+    uint32_t length;
+    uint8_t type;
+    uint8_t flags;
+    uint32_t stream;
+    const uint8_t * payload;    // points into the connection's input buffer
+} h2_frame;
+
+typedef struct h2_stream {
+    int64_t window;             // what we may still send on this stream
+    int request_done;           // END_STREAM seen, response under way
+    int code;
+    struct http_req req;
+    struct http_body body;      // length counts down as DATA goes out
+} h2_stream;
+
+typedef struct h2_conn {
+    int fd;
+    string doc_root;
+    char * clntName;
+    string inbuf;
+    size_t inpos;
+    int64_t window;             // connection level send window
+    uint32_t initial_window;    // peer's SETTINGS_INITIAL_WINDOW_SIZE
+    uint32_t max_frame;         // peer's SETTINGS_MAX_FRAME_SIZE
+    uint32_t last_stream;       // highest stream the client opened
+    uint32_t next_send;         // round robin position
+    int goaway;                 // GOAWAY sent or received, no new streams
+    int corked;
+    uint32_t header_stream;     // stream of an unfinished header block
+    uint8_t header_flags;
+    string header_block;
+    struct hpack_table decoder;
+    struct hpack_table encoder;
+    map<uint32_t, struct h2_stream> streams;
+} h2_conn;
+
+
+static void Put32(uint8_t * p, uint32_t v) {
+
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+
+static uint32_t Get32(const uint8_t * p) {
+
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+
+static void FrameHeader(uint8_t * hdr, uint32_t len, uint8_t type, uint8_t flags, uint32_t stream) {
+
+    hdr[0] = len >> 16;
+    hdr[1] = len >> 8;
+    hdr[2] = len;
+    hdr[3] = type;
+    hdr[4] = flags;
+    Put32(hdr + 5, stream & H2_MAX_WINDOW);
+}
+
+
+static int SendFrame(struct h2_conn * c, uint8_t type, uint8_t flags, uint32_t stream,
+                     const void * payload, size_t len) {
+
+    string frame(H2_FRAME_HEADER, '\0');
+    FrameHeader((uint8_t *)&frame[0], len, type, flags, stream);
+    frame.append((const char *)payload, len);
+    return SendAll(c->fd, frame.data(), frame.size());
+}
+
+
+static void SendGoaway(struct h2_conn * c, uint32_t error) {
+
+    uint8_t payload[8];
+    Put32(payload, c->last_stream);
+    Put32(payload + 4, error);
+    SendFrame(c, H2_GOAWAY, 0, 0, payload, sizeof(payload));
+    c->goaway = 1;
+}
+
+
+/*
+ *  Connection errors end the connection after a GOAWAY; always -1.
+ */
+static int ConnectionError(struct h2_conn * c, uint32_t error) {
+
+    cerr << "http2: connection error " << error << endl;
+    SendGoaway(c, error);
+    return -1;
+}
+
+
+static void SendWindowUpdate(struct h2_conn * c, uint32_t stream, uint32_t increment) {
+
+    uint8_t payload[4];
+    Put32(payload, increment);
+    SendFrame(c, H2_WINDOW_UPDATE, 0, stream, payload, sizeof(payload));
+}
+
+
+static void CloseStream(struct h2_conn * c, uint32_t id) {
+
+    struct h2_stream & s = c->streams[id];
+    if (s.body.own_fd) {
+        close(s.body.fd);
+    }
+    c->streams.erase(id);
+}
+
+
+static void ResetStream(struct h2_conn * c, uint32_t id, uint32_t error) {
+
+    uint8_t payload[4];
+    Put32(payload, error);
+    SendFrame(c, H2_RST_STREAM, 0, id, payload, sizeof(payload));
+    if (c->streams.count(id)) {
+        CloseStream(c, id);
+    }
+}
+
+
+static void SetCork(struct h2_conn * c, int on) {
+
+    if (c->corked != on) {
+        setsockopt(c->fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+        c->corked = on;
+    }
+}
+
+
+/*
+ *  Apply a SETTINGS payload from the peer. Returns 0 or an error code.
+ */
+static uint32_t ApplySettings(struct h2_conn * c, const uint8_t * p, size_t len) {
+
+    for (size_t i = 0; i + 6 <= len; i += 6) {
+        uint16_t id = p[i] << 8 | p[i + 1];
+        uint32_t value = Get32(p + i + 2);
+        switch (id) {
+            case H2_SETTINGS_HEADER_TABLE_SIZE:
+                HpackSetLimit(&c->encoder, value);
+                break;
+            case H2_SETTINGS_ENABLE_PUSH:
+                if (value > 1) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                break;
+            case H2_SETTINGS_INITIAL_WINDOW_SIZE: {
+                if (value > H2_MAX_WINDOW) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+                // applies to streams already open, too, none of which
+                // may end up with a window past the maximum (6.9.2)
+                int64_t delta = (int64_t)value - c->initial_window;
+                map<uint32_t, struct h2_stream>::iterator it;
+                for (it = c->streams.begin(); it != c->streams.end(); it++) {
+                    if (it->second.window + delta > H2_MAX_WINDOW) {
+                        return H2_FLOW_CONTROL_ERROR;
+                    }
+                }
+                for (it = c->streams.begin(); it != c->streams.end(); it++) {
+                    it->second.window += delta;
+                }
+                c->initial_window = value;
+                break;
+            }
+            case H2_SETTINGS_MAX_FRAME_SIZE:
+                if (value < H2_MAX_FRAME || value > 0xffffff) {
+                    return H2_PROTOCOL_ERROR;
+                }
+                c->max_frame = value;
+                break;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ *  Turn "Name: value\r\n" lines (as serialized for HTTP/1.1) into HTTP/2
+ *  header fields, which have lower case names.
+ */
+static void AddFieldLines(vector<struct hpack_field> & fields, const char * text, size_t len) {
+
+    const char * end = text + len;
+    while (text < end) {
+        const char * eol = (const char *)memchr(text, '\r', end - text);
+        if (eol == NULL) {
+            eol = end;
+        }
+        const char * colon = (const char *)memchr(text, ':', eol - text);
+        if (colon != NULL) {
+            struct hpack_field f;
+            f.name.assign(text, colon - text);
+            transform(f.name.begin(), f.name.end(), f.name.begin(), ::tolower);
+            const char * value = colon + 1;
+            while (value < eol && *value == ' ') {
+                value++;
+            }
+            f.value.assign(value, eol - value);
+            fields.push_back(f);
+        }
+        text = eol + 2;
+    }
+}
+
+
+/*
+ *  Send a header block, split over CONTINUATION frames if it doesn't fit
+ *  into one frame.
+ */
+static int SendHeaders(struct h2_conn * c, uint32_t id, uint8_t flags, const string & block) {
+
+    size_t pos = 0;
+    uint8_t type = H2_HEADERS;
+    do {
+        size_t n = min((size_t)c->max_frame, block.size() - pos);
+        uint8_t f = type == H2_HEADERS ? flags & H2_END_STREAM : 0;
+        if (pos + n == block.size()) {
+            f |= H2_END_HEADERS;
+        }
+        if (SendFrame(c, type, f, id, block.data() + pos, n) != 0) {
+            return -1;
+        }
+        pos += n;
+        type = H2_CONTINUATION;
+    } while (pos < block.size());
+    return 0;
+}
+
+
+/*
+ *  Resolve a complete request through the same path as HTTP/1.1 and send
+ *  the response header. The body, if any, is left to SendData.
+ */
+static int StartResponse(struct h2_conn * c, uint32_t id) {
+
+    struct h2_stream & s = c->streams[id];
+    char fields[HDR_MAX];
+    size_t fields_len = 0;
+    s.request_done = 1;
+    s.code = ResolveResponse(c->doc_root, &s.req, c->clntName, fields, &fields_len, &s.body);
+    cerr << "http2: stream " << id << " " << s.req.method << " " << s.req.uri
+         << " -> " << s.code << endl;
+
+    vector<struct hpack_field> hdrs;
+    struct hpack_field status = { ":status", to_string(s.code) };
+    hdrs.push_back(status);
+    struct hdr_span span = ServerHeader();
+    AddFieldLines(hdrs, span.data, span.len);
+    span = DateHeader();
+    AddFieldLines(hdrs, span.data, span.len);
+    AddFieldLines(hdrs, fields, fields_len);
+    string block;
+    HpackEncode(&c->encoder, hdrs, block);
+
+    int done = s.body.length == 0;
+    if (SendHeaders(c, id, done ? H2_END_STREAM : 0, block) != 0) {
+        return -1;
+    }
+    if (done) {
+        CountRequest(s.code);
+        CloseStream(c, id);
+    }
+    return 0;
+}
+
+
+/*
+ *  Build the HTTP/1.1-style request the file serving code expects out of
+ *  a decoded header block.
+ */
+static void Http2Request(const vector<struct hpack_field> & fields, struct http_req * req) {
+
+    req->valid = 0;
+    req->num_kvs = 0;
+    req->http_version = "HTTP/2";
+    for (size_t i = 0; i < fields.size(); i++) {
+        if (fields[i].name == ":method") {
+            req->method = fields[i].value;
+        }
+        else if (fields[i].name == ":path") {
+            req->uri = fields[i].value;
+        }
+        else if (fields[i].name == "accept-encoding" && req->num_kvs < KV_SIZE) {
+            req->kv[req->num_kvs].key = "Accept-Encoding";
+            req->kv[req->num_kvs].val = " " + fields[i].value;
+            req->num_kvs++;
+        }
+        else if (fields[i].name == "accept" && req->num_kvs < KV_SIZE) {
+            req->kv[req->num_kvs].key = "Accept";
+            req->kv[req->num_kvs].val = " " + fields[i].value;
+            req->num_kvs++;
+        }
+    }
+    if (req->uri == "/") {
+        req->uri = "/index.html";
+    }
+    req->valid = req->method == "GET" && req->uri.substr(0, 1) == "/";
+}
+
+
+/*
+ *  A header block is complete: decode it and open (or finish) the stream.
+ */
+static int EndHeaders(struct h2_conn * c, uint32_t id) {
+
+    vector<struct hpack_field> fields;
+    int end_stream = c->header_flags & H2_END_STREAM;
+    c->header_stream = 0;
+    // decode even if the stream gets refused, the table must stay in sync
+    if (HpackDecode(&c->decoder, (const uint8_t *)c->header_block.data(),
+                    c->header_block.size(), fields) != 0) {
+        return ConnectionError(c, H2_COMPRESSION_ERROR);
+    }
+    c->header_block.clear();
+
+    if (c->streams.count(id)) {
+        // trailers after a request body
+        if (c->streams[id].request_done || !end_stream) {
+            ResetStream(c, id, H2_PROTOCOL_ERROR);
+            return 0;
+        }
+        return StartResponse(c, id);
+    }
+    if (id <= c->last_stream) {
+        return ConnectionError(c, H2_STREAM_CLOSED);
+    }
+    c->last_stream = id;
+    if (c->goaway || c->streams.size() >= H2_MAX_STREAMS) {
+        ResetStream(c, id, H2_REFUSED_STREAM);
+        return 0;
+    }
+    struct h2_stream & s = c->streams[id];
+    s.window = c->initial_window;
+    s.request_done = 0;
+    s.code = 0;
+    s.body.fd = -1;
+    s.body.own_fd = 0;
+    s.body.offset = 0;
+    s.body.length = 0;
+    Http2Request(fields, &s.req);
+    if (end_stream) {
+        return StartResponse(c, id);
+    }
+    return 0;
+}
+
+
+/*
+ *  Strip padding (and priority) from a DATA or HEADERS payload.
+ *  Returns -1 if the padding is longer than the frame.
+ */
+static int StripPadding(struct h2_frame * f) {
+
+    size_t skip = 0;
+    size_t pad = 0;
+    if (f->flags & H2_PADDED) {
+        if (f->length < 1) {
+            return -1;
+        }
+        pad = f->payload[0];
+        skip = 1;
+    }
+    if (f->type == H2_HEADERS && (f->flags & H2_PRIORITY_FLAG)) {
+        skip += 5;
+    }
+    if (skip + pad > f->length) {
+        return -1;
+    }
+    f->payload += skip;
+    f->length -= skip + pad;
+    return 0;
+}
+
+
+/*
+ *  Act on one frame from the client. Returns -1 if the connection is done.
+ */
+static int HandleFrame(struct h2_conn * c, struct h2_frame * f) {
+
+    if (c->header_stream != 0 && (f->type != H2_CONTINUATION || f->stream != c->header_stream)) {
+        return ConnectionError(c, H2_PROTOCOL_ERROR);
+    }
+    switch (f->type) {
+        case H2_DATA: {
+            uint32_t consumed = f->length;
+            if (f->stream == 0 || StripPadding(f) != 0) {
+                return ConnectionError(c, H2_PROTOCOL_ERROR);
+            }
+            // request bodies are read and dropped, so hand the window back
+            if (consumed > 0) {
+                SendWindowUpdate(c, 0, consumed);
+            }
+            if (!c->streams.count(f->stream) || c->streams[f->stream].request_done) {
+                if (f->stream > c->last_stream) {
+                    return ConnectionError(c, H2_PROTOCOL_ERROR);
+                }
+                ResetStream(c, f->stream, H2_STREAM_CLOSED);
+                return 0;
+            }
+            if (f->flags & H2_END_STREAM) {
+                return StartResponse(c, f->stream);
+            }
+            if (consumed > 0) {
+                SendWindowUpdate(c, f->stream, consumed);
+            }
+            return 0;
+        }
+        case H2_HEADERS:
+            if (f->stream == 0 || f->stream % 2 == 0 || StripPadding(f) != 0) {
+                return ConnectionError(c, H2_PROTOCOL_ERROR);
+            }
+            c->header_block.assign((const char *)f->payload, f->length);
+            c->header_flags = f->flags;
+            if (f->flags & H2_END_HEADERS) {
+                return EndHeaders(c, f->stream);
+            }
+            c->header_stream = f->stream;
+            return 0;
+        case H2_CONTINUATION:
+            if (c->header_stream == 0) {
+                return ConnectionError(c, H2_PROTOCOL_ERROR);
+            }
+            c->header_block.append((const char *)f->payload, f->length);
+            if (c->header_block.size() > HPACK_MAX_LIST) {
+                return ConnectionError(c, H2_PROTOCOL_ERROR);
+            }
+            if (f->flags & H2_END_HEADERS) {
+                return EndHeaders(c, f->stream);
+            }
+            return 0;
+        case H2_RST_STREAM:
+            if (f->length != 4) {
+                return ConnectionError(c, H2_FRAME_SIZE_ERROR);
+            }
+            if (f->stream == 0 || f->stream > c->last_stream) {
+                return ConnectionError(c, H2_PROTOCOL_ERROR);
+            }
+            if (c->streams.count(f->stream)) {
+                CloseStream(c, f->stream);
+            }
+            return 0;
+        case H2_SETTINGS: {
+            if (f->stream != 0) {
+                return ConnectionError(c, H2_PROTOCOL_ERROR);
+            }
+            if (f->flags & H2_ACK) {
+                return f->length == 0 ? 0 : ConnectionError(c, H2_FRAME_SIZE_ERROR);
+            }
+            if (f->length % 6 != 0) {
+                return ConnectionError(c, H2_FRAME_SIZE_ERROR);
+            }
+            uint32_t error = ApplySettings(c, f->payload, f->length);
+            if (error != 0) {
+                return ConnectionError(c, error);
+            }
+            return SendFrame(c, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+        }
+        case H2_PING:
+            if (f->length != 8) {
+                return ConnectionError(c, H2_FRAME_SIZE_ERROR);
+            }
+            if (f->stream != 0) {
+                return ConnectionError(c, H2_PROTOCOL_ERROR);
+            }
+            if (f->flags & H2_ACK) {
+                return 0;
+            }
+            return SendFrame(c, H2_PING, H2_ACK, 0, f->payload, 8);
+        case H2_GOAWAY:
+            // finish what is in flight, then close
+            c->goaway = 1;
+            return 0;
+        case H2_WINDOW_UPDATE: {
+            if (f->length != 4) {
+                return ConnectionError(c, H2_FRAME_SIZE_ERROR);
+            }
+            uint32_t increment = Get32(f->payload) & H2_MAX_WINDOW;
+            if (f->stream == 0) {
+                c->window += increment;
+                if (increment == 0) {
+                    return ConnectionError(c, H2_PROTOCOL_ERROR);
+                }
+                if (c->window > H2_MAX_WINDOW) {
+                    return ConnectionError(c, H2_FLOW_CONTROL_ERROR);
+                }
+            }
+            else if (c->streams.count(f->stream)) {
+                struct h2_stream & s = c->streams[f->stream];
+                s.window += increment;
+                if (increment == 0) {
+                    ResetStream(c, f->stream, H2_PROTOCOL_ERROR);
+                }
+                else if (s.window > H2_MAX_WINDOW) {
+                    ResetStream(c, f->stream, H2_FLOW_CONTROL_ERROR);
+                }
+            }
+            return 0;
+        }
+        case H2_PRIORITY:
+            // checked, then ignored: we don't prioritize
+            if (f->stream == 0) {
+                return ConnectionError(c, H2_PROTOCOL_ERROR);
+            }
+            if (f->length != 5) {
+                ResetStream(c, f->stream, H2_FRAME_SIZE_ERROR);
+            }
+            return 0;
+        case H2_PUSH_PROMISE:
+            // only servers push
+            return ConnectionError(c, H2_PROTOCOL_ERROR);
+        default:
+            // unknown frame types are ignored
+            return 0;
+    }
+}
+
+
+/*
+ *  Read the next frame into f, blocking until it is complete. Returns
+ *  like recv(): 1 for a frame, 0 if the client closed, -1 on error
+ *  (EINTR, or EAGAIN once the idle timeout hits).
+ */
+static ssize_t ReadFrame(struct h2_conn * c, struct h2_frame * f) {
+
+    // drop what has been consumed before the buffer grows again
+    if (c->inpos > 0 && c->inpos == c->inbuf.size()) {
+        c->inbuf.clear();
+        c->inpos = 0;
+    }
+    else if (c->inpos > H2_MAX_FRAME) {
+        c->inbuf.erase(0, c->inpos);
+        c->inpos = 0;
+    }
+    const uint8_t * p;
+    while (1) {
+        size_t have = c->inbuf.size() - c->inpos;
+        p = (const uint8_t *)c->inbuf.data() + c->inpos;
+        if (have >= H2_FRAME_HEADER) {
+            f->length = p[0] << 16 | p[1] << 8 | p[2];
+            if (f->length > H2_MAX_FRAME) {
+                errno = EMSGSIZE;
+                return -1;
+            }
+            if (have >= H2_FRAME_HEADER + f->length) {
+                break;
+            }
+        }
+        char buffer[H2_MAX_FRAME];
+        ssize_t n = ConnRecv(c->fd, buffer, sizeof(buffer));
+        if (n <= 0) {
+            return n;
+        }
+        c->inbuf.append(buffer, n);
+    }
+    f->type = p[3];
+    f->flags = p[4];
+    f->stream = Get32(p + 5) & H2_MAX_WINDOW;
+    f->payload = p + H2_FRAME_HEADER;
+    c->inpos += H2_FRAME_HEADER + f->length;
+    return 1;
+}
+
+
+/*
+ *  Whether a whole frame can be read without blocking.
+ */
+static int FrameReady(struct h2_conn * c) {
+
+    size_t have = c->inbuf.size() - c->inpos;
+    if (have >= H2_FRAME_HEADER) {
+        const uint8_t * p = (const uint8_t *)c->inbuf.data() + c->inpos;
+        if (have >= H2_FRAME_HEADER + (size_t)(p[0] << 16 | p[1] << 8 | p[2])) {
+            return 1;
+        }
+    }
+    struct pollfd pfd;
+    pfd.fd = c->fd;
+    pfd.events = POLLIN;
+    return poll(&pfd, 1, 0) > 0;
+}
+
+
+static int Sendable(const struct h2_stream & s) {
+
+    return s.request_done && s.body.length > 0 && s.window > 0;
+}
+
+
+/*
+ *  Send one DATA frame for the next stream (round robin) that has body
+ *  left and window to send it in. Returns 0 if nothing could be sent,
+ *  1 if a frame went out and -1 if the connection failed.
+ */
+static int SendData(struct h2_conn * c) {
+
+    if (c->window <= 0 || c->streams.empty()) {
+        return 0;
+    }
+    map<uint32_t, struct h2_stream>::iterator it = c->streams.upper_bound(c->next_send);
+    size_t tried;
+    for (tried = 0; tried < c->streams.size(); tried++, it++) {
+        if (it == c->streams.end()) {
+            it = c->streams.begin();
+        }
+        if (Sendable(it->second)) {
+            break;
+        }
+    }
+    if (tried == c->streams.size()) {
+        return 0;
+    }
+    uint32_t id = it->first;
+    struct h2_stream & s = it->second;
+    off_t n = min((off_t)c->max_frame, s.body.length);
+    n = min(n, (off_t)min(s.window, c->window));
+    int last = n == s.body.length;
+
+    SetCork(c, 1);
+    uint8_t hdr[H2_FRAME_HEADER];
+    FrameHeader(hdr, n, H2_DATA, last ? H2_END_STREAM : 0, id);
+    if (SendAll(c->fd, (const char *)hdr, sizeof(hdr)) != 0) {
+        return -1;
+    }
+    // a frame has to go out whole, whatever sendfile() manages per call
+    off_t end = s.body.offset + n;
+    while (s.body.offset < end) {
+        ssize_t sent = ConnSendfile(c->fd, s.body.fd, &s.body.offset, end - s.body.offset);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            cerr << "sendfile() failed" << endl;
+            return -1;
+        }
+        CountBytes(sent);
+    }
+    s.body.length -= n;
+    s.window -= n;
+    c->window -= n;
+    c->next_send = id;
+    if (last) {
+        CountRequest(s.code);
+        CloseStream(c, id);
+    }
+    return 1;
+}
+
+
+static int Base64Value(char ch) {
+
+    if (ch >= 'A' && ch <= 'Z') return ch - 'A';
+    if (ch >= 'a' && ch <= 'z') return ch - 'a' + 26;
+    if (ch >= '0' && ch <= '9') return ch - '0' + 52;
+    if (ch == '-' || ch == '+') return 62;
+    if (ch == '_' || ch == '/') return 63;
+    return -1;
+}
+
+
+/*
+ *  HTTP2-Settings carries a SETTINGS payload in unpadded base64url.
+ */
+static string Base64UrlDecode(const string & in) {
+
+    string out;
+    uint32_t acc = 0;
+    int bits = 0;
+    for (size_t i = 0; i < in.size(); i++) {
+        int v = Base64Value(in[i]);
+        if (v < 0) {
+            continue;
+        }
+        acc = acc << 6 | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            out.push_back((char)(acc >> bits));
+        }
+    }
+    return out;
+}
+
+
+int IsHttp2Preface(const char * buffer, size_t len) {
+
+    // RecvHttpMessage stops at the first blank line, 18 bytes in
+    return len >= 18 && memcmp(buffer, H2_PREFACE, min(len, (size_t)H2_PREFACE_LEN)) == 0;
+}
+
+
+static const char * FindHeader(struct http_req * req, const char * key) {
+
+    for (int i = 0; i < req->num_kvs; i++) {
+        if (strcasecmp(req->kv[i].key.c_str(), key) == 0) {
+            return req->kv[i].val.c_str();
+        }
+    }
+    return NULL;
+}
+
+
+int IsH2cUpgrade(struct http_req * req) {
+
+    const char * upgrade = FindHeader(req, "Upgrade");
+    return req->valid && upgrade != NULL && strstr(upgrade, "h2c") != NULL &&
+           FindHeader(req, "HTTP2-Settings") != NULL;
+}
+
+
+/*
+ *  Run an HTTP/2 connection until the client goes away, it idles out or
+ *  an upgrade drains us. data/len is what has been read off the socket
+ *  already: the start of the preface, or with upgrade set, nothing of
+ *  HTTP/2 yet, since the client only sends the preface after our 101.
+ */
+void ServeHttp2(int fd, string doc_root, char * clntName, const char * data, size_t len,
+                struct http_req * upgrade) {
+
+    struct h2_conn c;
+    c.fd = fd;
+    c.doc_root = doc_root;
+    c.clntName = clntName;
+    c.inpos = 0;
+    c.window = H2_DEFAULT_WINDOW;
+    c.initial_window = H2_DEFAULT_WINDOW;
+    c.max_frame = H2_MAX_FRAME;
+    c.last_stream = 0;
+    c.next_send = 0;
+    c.goaway = 0;
+    c.corked = 0;
+    c.header_stream = 0;
+    c.header_flags = 0;
+    HpackInit(&c.decoder, HPACK_TABLE_SIZE);
+    HpackInit(&c.encoder, HPACK_TABLE_SIZE);
+
+    // frames are small and many; CORK batches them while DATA is flowing
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // a bad HTTP2-Settings is a connection error, reported once our own
+    // SETTINGS (which must come first) is out
+    uint32_t error = 0;
+    if (upgrade != NULL) {
+        if (SendAll(fd, H2C_SWITCHING, strlen(H2C_SWITCHING)) != 0) {
+            return;
+        }
+        string settings = Base64UrlDecode(FindHeader(upgrade, "HTTP2-Settings"));
+        error = ApplySettings(&c, (const uint8_t *)settings.data(),
+                              settings.size() - settings.size() % 6);
+    }
+    else {
+        c.inbuf.assign(data, len);
+    }
+
+    uint8_t settings[6];
+    settings[0] = 0;
+    settings[1] = H2_SETTINGS_MAX_CONCURRENT_STREAMS;
+    Put32(settings + 2, H2_MAX_STREAMS);
+    if (SendFrame(&c, H2_SETTINGS, 0, 0, settings, sizeof(settings)) != 0) {
+        return;
+    }
+    if (error != 0) {
+        ConnectionError(&c, error);
+        return;
+    }
+
+    // the upgraded request is stream 1, half closed from the client's side
+    if (upgrade != NULL) {
+        c.last_stream = 1;
+        struct h2_stream & s = c.streams[1];
+        s.window = c.initial_window;
+        s.req = *upgrade;
+        s.body.fd = -1;
+        s.body.own_fd = 0;
+        if (StartResponse(&c, 1) != 0) {
+            return;
+        }
+    }
+
+    while (c.inbuf.size() < H2_PREFACE_LEN) {
+        char buffer[H2_PREFACE_LEN];
+        ssize_t n = ConnRecv(fd, buffer, H2_PREFACE_LEN - c.inbuf.size());
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        c.inbuf.append(buffer, n);
+    }
+    if (c.inbuf.compare(0, H2_PREFACE_LEN, H2_PREFACE) != 0) {
+        cerr << "http2: bad connection preface" << endl;
+    }
+    else {
+        c.inpos = H2_PREFACE_LEN;
+        while (1) {
+            if (UpgradePending() && !c.goaway) {
+                SendGoaway(&c, H2_NO_ERROR);
+            }
+            if (c.goaway && c.streams.empty()) {
+                break;
+            }
+            // keep responses flowing, but never at the expense of reading
+            // what the client sends (window updates, new requests)
+            if (!FrameReady(&c)) {
+                int sent = SendData(&c);
+                if (sent < 0) {
+                    break;
+                }
+                if (sent > 0) {
+                    continue;
+                }
+            }
+            // nothing to send until the client says something
+            SetCork(&c, 0);
+            struct h2_frame f;
+            ssize_t n = ReadFrame(&c, &f);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && errno == EMSGSIZE) {
+                ConnectionError(&c, H2_FRAME_SIZE_ERROR);
+                break;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                // idle for SOCK_TIMEOUT
+                SendGoaway(&c, H2_NO_ERROR);
+                break;
+            }
+            if (n <= 0 || HandleFrame(&c, &f) != 0) {
+                break;
+            }
+        }
+    }
+    SetCork(&c, 0);
+    while (!c.streams.empty()) {
+        CloseStream(&c, c.streams.begin()->first);
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+using namespace std;
+
+struct http_req;
+
+/*
+ *  Cleartext HTTP/2 (RFC 7540). A connection becomes HTTP/2 either by
+ *  opening with the connection preface (prior knowledge) or by upgrading
+ *  an HTTP/1.1 request that carries "Upgrade: h2c", whose response then
+ *  goes out on stream 1. Any number of streams share the connection:
+ *  each request is resolved as soon as its header block is complete, and
+ *  the DATA frames of all responses in flight are interleaved round robin,
+ *  each as large as the peer's frame size and flow control windows allow.
+ *  Response bodies still go out with sendfile() from the file (or archive)
+ *  they live in.
+ */
+#define H2_PREFACE          "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN      24
+#define H2C_SWITCHING       "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n"
+#define H2_FRAME_HEADER     9
+#define H2_MAX_FRAME        16384       // what we accept; we never raise it
+#define H2_DEFAULT_WINDOW   65535
+#define H2_MAX_WINDOW       0x7fffffff
+#define H2_MAX_STREAMS      100
+
+// frame types
+#define H2_DATA             0x0
+#define H2_HEADERS          0x1
+#define H2_PRIORITY         0x2
+#define H2_RST_STREAM       0x3
+#define H2_SETTINGS         0x4
+#define H2_PUSH_PROMISE     0x5
+#define H2_PING             0x6
+#define H2_GOAWAY           0x7
+#define H2_WINDOW_UPDATE    0x8
+#define H2_CONTINUATION     0x9
+
+// frame flags
+#define H2_END_STREAM       0x1
+#define H2_ACK              0x1
+#define H2_END_HEADERS      0x4
+#define H2_PADDED           0x8
+#define H2_PRIORITY_FLAG    0x20
+
+// settings
+#define H2_SETTINGS_HEADER_TABLE_SIZE       0x1
+#define H2_SETTINGS_ENABLE_PUSH             0x2
+#define H2_SETTINGS_MAX_CONCURRENT_STREAMS  0x3
+#define H2_SETTINGS_INITIAL_WINDOW_SIZE     0x4
+#define H2_SETTINGS_MAX_FRAME_SIZE          0x5
+
+// error codes
+#define H2_NO_ERROR             0x0
+#define H2_PROTOCOL_ERROR       0x1
+#define H2_FLOW_CONTROL_ERROR   0x3
+#define H2_STREAM_CLOSED        0x5
+#define H2_FRAME_SIZE_ERROR     0x6
+#define H2_REFUSED_STREAM       0x7
+#define H2_COMPRESSION_ERROR    0x9
+
+int IsHttp2Preface(const char * buffer, size_t len);
+int IsH2cUpgrade(struct http_req * req);
+void ServeHttp2(int fd, string doc_root, char * clntName, const char * data, size_t len,
+                struct http_req * upgrade);
+
+#endif // HTTP2_H
@@ -1,4 +1,16 @@
 #include "httpd.h"
+#include "archive.h"
+#include "mime.h"
+#include "hdrcache.h"
+#include "upgrade.h"
+#include "prefork.h"
+#include "capture.h"
+#include "dirlist.h"
+#include "flight.h"
+#include "tls.h"
+#include "http2.h"
+#include <signal.h>
+#include <poll.h>
 
 /* Author: Henry Gaudet
  * Date: Mon Feb 13 2017
@@ -10,11 +22,28 @@
  * pipelining and access based on ip addresses defined in a .htaccess
  * file in the same directory as the requested resource. It does not support
  * multithreading/thread pools
+ *
+ * If the docroot argument is a packed archive (see archive.h) instead of a
+ * directory, files are served straight out of the archive. SIGHUP reopens
+ * the archive so a new one can be renamed over it. SIGUSR2 hands the
+ * listening socket to a freshly exec'd binary (see upgrade.h). With
+ * -w the accept loop runs in prefork worker processes (see prefork.h).
+ * With -t an HTTPS listener is served alongside the plain one (see tls.h).
+ * Plain connections may switch to HTTP/2 (see http2.h). With -l
+ * directories without an index.html are listed (see dirlist.h). With -S
+ * requests slower than a threshold are logged (see flight.h). -o sets the
+ * listeners' socket options (see sockopt.h).
  */
 
 
 using namespace std;
 
+static struct site_archive site;
+static int use_archive = 0;
+static volatile sig_atomic_t reload_archive = 0;
+static int tls_listen_fd = -1;
+static int dir_listings = 0;
+
 /*
  *  Converts a string to a char *
  */
@@ -57,14 +86,30 @@ ssize_t RecvHttpMessage(int clnt_socket, char * buffer) {
     ssize_t num_bytes_rcvd = 0;
     char * term;
 
+    PROBE1(recv__entry, clnt_socket);
+
     while (1) {
-        num_bytes_rcvd = recv(clnt_socket,
-                            buffer + total_bytes_rcvd,
-                            BUFSIZE - total_bytes_rcvd, 0);
+        num_bytes_rcvd = ConnRecv(clnt_socket,
+                                  buffer + total_bytes_rcvd,
+                                  BUFSIZE - total_bytes_rcvd);
+        if (num_bytes_rcvd < 0 && errno == EINTR) {
+            // an idle connection gives way to a pending upgrade, which
+            // the accept loop then performs
+            if (UpgradePending() && total_bytes_rcvd == 0) {
+                break;
+            }
+            continue;
+        }
         if (num_bytes_rcvd <= 0) {
             cerr << "recv() failed in RecvHttpMessage" << endl;
             break;
         }
+        // the request starts when its first bytes are in, not while the
+        // connection sits idle
+        if (total_bytes_rcvd == 0) {
+            FlightBegin(clnt_socket);
+        }
+        FlightSyscall(FLIGHT_SYS_RECV);
 
         total_bytes_rcvd += num_bytes_rcvd;
         
@@ -73,6 +118,7 @@ ssize_t RecvHttpMessage(int clnt_socket, char * buffer) {
             break;
         }
     }
+    PROBE2(recv__return, clnt_socket, total_bytes_rcvd);
     return total_bytes_rcvd;
     
 }
@@ -83,6 +129,7 @@ ssize_t RecvHttpMessage(int clnt_socket, char * buffer) {
  */
 struct http_req ParseHttpMessage(char * buffer) {
     
+    PROBE(parse__entry);
     struct http_req req;
     string message(buffer);
     int firstline = 1;
@@ -174,80 +221,58 @@ struct http_req ParseHttpMessage(char * buffer) {
     }
     
     req.num_kvs = kv_idx;
+    PROBE2(parse__return, req.valid, req.uri.c_str());
     return req;
 }
 
 
 /*
- *  Create an http response object to send back to the client
+ *  Create an http response object to send back to the client.
+ *  Status lines and header strings live in hdrcache; this only
+ *  fills in what varies per file.
  */
 struct http_res BuildHttpResponse(int response_code, string fname) {
     
     struct http_res res;
     struct stat finfo;
-    struct tm *time;
-    char buffer[32];
-    string ext;
     
-    switch (response_code) {
-        
-        // 200
-        case RESP_OK:   
-                if (stat(fname.c_str(), &finfo) == 0) {
-                    time = gmtime(&(finfo.st_mtime));
-                }
-                else {
-                    cerr << "error building response" << endl;
-                }
-                res.response = "200 OK";
-                strftime(buffer, 32, "%a, %d %b %Y %X %Z", time);
-                res.last_modified = string(buffer);
-                ext = fname.substr(fname.find('.') + 1);
-                if (!ext.compare("html")) {
-                    res.content_type = "text/html";
-                }
-                else if (!ext.compare("jpg") || !ext.compare("jpeg")) {
-                    res.content_type = "image/jpeg";
-                }
-                else if (!ext.compare("png") || !ext.compare("PNG")) {
-                    res.content_type = "image/png";
-                }
-                else {
-                    res.content_type = "unknown";
-                }
-                res.content_length = (int)finfo.st_size;
-                res.fname = fname;
-                break;
-        // 400
-        case RESP_CERROR:   
-                res.response = "400 Client Error";
-                break;
-        // 403
-        case RESP_FORBIDDEN:    
-                res.response = "403 Forbidden";
-                break;
-        // 404
-        case RESP_NOTFOUND:     
-                res.response = "404 Not Found";
-                break;
-        // 405
-        case RESP_SERROR:
-                res.response = "500 Server Error";
-                break;
+    PROBE1(build__entry, response_code);
+    res.code = response_code;
+    res.close = 0;
+    res.last_modified = -1;
+    res.content_type = NULL;
+    res.content_encoding = NULL;
+    res.vary = NULL;
+    res.content_length = 0;
+    res.chunked = 0;
+
+    if (response_code == RESP_MOVED) {
+        res.location = fname;
+    }
+    if (response_code == RESP_OK) {
+        FlightSyscall(FLIGHT_SYS_STAT);
+        if (stat(fname.c_str(), &finfo) != 0) {
+            // file vanished between CheckFile and now
+            cerr << "error building response" << endl;
+            res.code = RESP_NOTFOUND;
+            PROBE1(build__return, res.code);
+            return res;
+        }
+        res.last_modified = finfo.st_mtime;
+        res.content_type = MimeType(fname);
+        res.content_length = finfo.st_size;
+        res.fname = fname;
     }
-    res.http_version = "HTTP/1.1";
-    // server name always required
-    res.server = SERV_NAME;
+    PROBE1(build__return, res.code);
     return res;
 }
 
 
 /*
- *  Get the file permissions as detailed in a .htaccess file
+ *  Parse .htaccess rules ("deny from 10.0.0.0/8", one per line)
  */
-vector<struct kv_pairs> GetPermissions(string doc_root) {
-    
-    char fname[PATH_MAX];
+vector<struct kv_pairs> ParsePermissions(istream & rules) {
+
     char ip_string[15];
     struct addrinfo hints, *addr_in;
     string deny, trash, ip;
@@ -264,6 +289,36 @@ vector<struct kv_pairs> GetPermissions(string doc_root) {
     hints.ai_socktype = SOCK_STREAM;
     hints.ai_protocol = IPPROTO_TCP;
 
+    while (rules >> deny >> trash >> ip) {
+        if (getaddrinfo(ip.c_str(), NULL, &hints, &addr_in) == 0) {
+            inet_ntop(AF_INET,
+                      &( (struct sockaddr_in *) addr_in->ai_addr)->sin_addr,
+                      ip_string,
+                      sizeof(ip_string));
+            ip = string(ip_string);
+            freeaddrinfo(addr_in);
+        }
+        // add rule to rules vector
+        struct kv_pairs permission;
+        permission.key = ip;
+        permission.val = deny;
+        permissions.push_back(permission);
+    }
+    
+    return permissions;
+}
+
+
+/*
+ *  Get the file permissions as detailed in a .htaccess file: the one next
+ *  to the file, or in the directory itself if given with a trailing '/'
+ */
+vector<struct kv_pairs> GetPermissions(string doc_root) {
+    
+    PROBE1(perms__entry, doc_root.c_str());
+    char fname[PATH_MAX];
+    vector<struct kv_pairs> permissions;
+
     // hack b/c this is due in 2 hrs. thx c++ algs =)
     // get requested resource's directory
     string copy(doc_root);
@@ -272,37 +327,28 @@ vector<struct kv_pairs> GetPermissions(string doc_root) {
     reverse(hta_loc.begin(), hta_loc.end());
 
     // get .htaccess for this directory
+    FlightSyscall(FLIGHT_SYS_STAT);
     if (realpath((hta_loc + ".htaccess").c_str(), fname) != 0) {
         // htaccess found, open and read rules
+        FlightSyscall(FLIGHT_SYS_OPEN);
         ifstream infile(string(fname).c_str());
         if (infile.is_open()) {
-            while (infile >> deny >> trash >> ip) {
-                if (getaddrinfo(ip.c_str(), NULL, &hints, &addr_in) == 0) {
-                    inet_ntop(AF_INET,
-                              &( (struct sockaddr_in *) addr_in->ai_addr)->sin_addr,
-                              ip_string,
-                              sizeof(ip_string));
-                    ip = string(ip_string);
-                    freeaddrinfo(addr_in);
-                }
-                // add rule to rules vector
-                struct kv_pairs permission;
-                permission.key = ip;
-                permission.val = deny;
-                permissions.push_back(permission);
-            }
+            permissions = ParsePermissions(infile);
         }
     }
-    
+    if (permissions.empty()) {
+        istringstream none;
+        permissions = ParsePermissions(none);
+    }
+    PROBE1(perms__return, permissions.size());
     return permissions;
 }
 
 
 /*
- *  Helper function to match 2 ipv4 addresses.
- *  Return 0 if clnt_addr is within range of serv_addr
+ *  MatchAddr, less the probes.
  */
-int MatchAddr(string serv_addr, string clnt_addr) {
+static int MatchOctets(string serv_addr, string clnt_addr) {
     
     int f, l, num_octs;
     string oct; 
@@ -333,72 +379,116 @@ int MatchAddr(string serv_addr, string clnt_addr) {
 }
 
 
+/*
+ *  Helper function to match 2 ipv4 addresses.
+ *  Return 0 if clnt_addr is within range of serv_addr
+ */
+int MatchAddr(string serv_addr, string clnt_addr) {
+
+    PROBE2(match__entry, serv_addr.c_str(), clnt_addr.c_str());
+    int rc = MatchOctets(serv_addr, clnt_addr);
+    PROBE1(match__return, rc);
+    return rc;
+}
+
+
 /*
  *  Check if client ip is banned or not
  */
 int CheckPermissions(vector<struct kv_pairs> perms, char * clnt_addr) {
 
+    PROBE2(acl__entry, clnt_addr, perms.size());
+    int denied = 0;
     for (vector<struct kv_pairs>::iterator it = perms.begin(); it != perms.end(); it++) {
         string check_addr = it->key;
         if (MatchAddr(check_addr, string(clnt_addr)) == 0) {
-            if ((it->val).compare("deny") == 0) {
-                return 1;
-            }
-            else {
-                return 0;
-            }
+            denied = (it->val).compare("deny") == 0;
+            break;
         }
     }
-    return 0;
+    PROBE1(acl__return, denied);
+    return denied;
 }
 
 
 /*
- *  Check if a file at a given location:
- *  1) exists
- *  2) is a regular file
- *  3) is accessible given user permissions
+ *  Whether resolved path is doc_root or something in it; "/www2" is not
+ *  under "/www".
  */
-int CheckFile(string doc_root, string uri, char * fname, char * clntName) {
+int UnderRoot(string doc_root, const char * path) {
+
+    size_t len = doc_root.length();
+    if (strncmp(path, doc_root.c_str(), len) != 0) {
+        return 0;
+    }
+    return path[len] == '\0' || path[len] == '/' || (len > 0 && doc_root[len - 1] == '/');
+}
+
+
+/*
+ *  CheckFile, less the probes.
+ */
+static int CheckPath(string doc_root, string uri, char * fname, char * clntName) {
     
     char fullpath[PATH_MAX];
     struct stat sb;
     string file_loc = doc_root + uri;
 
     // Does file exist?
+    FlightSyscall(FLIGHT_SYS_STAT);
     if (realpath(file_loc.c_str(), fullpath) == 0) {
         return RESP_NOTFOUND;
     }
     
-    // File exists, does user have permission?
-    string test_fp = string(fullpath).substr(0, doc_root.length());
-    if (doc_root.compare(test_fp)) {
+    // File exists, is it under the document root?
+    if (!UnderRoot(doc_root, fullpath)) {
         return RESP_FORBIDDEN;
     }
-    else {
-        // get htaccess permissions
-        vector<struct kv_pairs> permissions = GetPermissions(fullpath);
-        // check client against htaccess permissions
-        if (CheckPermissions(permissions, clntName) != 0) {
-            return RESP_FORBIDDEN;
-        }
+    FlightSyscall(FLIGHT_SYS_STAT);
+    if (stat(fullpath, &sb) != 0) {
+        return RESP_NOTFOUND;
     }
-    
-    // File exists and user has permission; is it a regular file?
-    if (stat(file_loc.c_str(), &sb) == 0 && S_ISDIR(sb.st_mode)) {
-        string temp = file_loc + "index.html";
-        if (realpath(temp.c_str(), fullpath) == 0) {
-            memset(fullpath, 0, PATH_MAX);
+
+    // does user have permission? a directory's index and listing are made
+    // of what is in it, so it goes by its own .htaccess, not its parent's
+    string rules_for = string(fullpath) + (S_ISDIR(sb.st_mode) ? "/" : "");
+    vector<struct kv_pairs> permissions = GetPermissions(rules_for);
+    if (CheckPermissions(permissions, clntName) != 0) {
+        return RESP_FORBIDDEN;
+    }
+
+    // File exists and user has permission; is it a directory?
+    if (S_ISDIR(sb.st_mode)) {
+        // relative links from the index only resolve under "dir/"
+        if (uri.empty() || uri[uri.length() - 1] != '/') {
+            // the Location field has to fit in the response header
+            if (uri.length() >= HDR_MAX / 2 || uri.find_first_of("\r\n") != string::npos) {
+                return RESP_NOTFOUND;
+            }
+            strcpy(fname, (uri + "/").c_str());
+            return RESP_MOVED;
+        }
+        string dir = string(fullpath) + "/";
+        string index = dir + "index.html";
+        struct stat isb;
+        FlightSyscall(FLIGHT_SYS_STAT);
+        if (stat(index.c_str(), &isb) == 0 && S_ISREG(isb.st_mode)) {
+            // serve the directory's index.html instead
+            if (index.length() >= PATH_MAX) {
+                return RESP_NOTFOUND;
+            }
+            strcpy(fullpath, index.c_str());
+            sb = isb;
+        }
+        else if (!dir_listings) {
             return RESP_NOTFOUND;
         }
-        else {
-            // File was directory, but there is an index.html in requested
-            // directory, so return that instead
-            //return RESP_APPEND_OK;
-       
-            // nvm don't want to mess up the autograder 
+        else if (dir.length() >= PATH_MAX) {
             return RESP_NOTFOUND;
         }
+        else {
+            strcpy(fullpath, dir.c_str());
+        }
     }
     
     // Is file world readable?
@@ -418,59 +508,545 @@ int CheckFile(string doc_root, string uri, char * fname, char * clntName) {
 
 
 /*
- *  Sends a response back to the client
+ *  Check if a file at a given location:
+ *  1) exists
+ *  2) is a regular file, or a directory with an index.html (or that may
+ *     be listed, in which case fname gets its path with a trailing '/')
+ *  3) is accessible given user permissions
+ *  A directory asked for without the trailing '/' is RESP_MOVED, with the
+ *  URI to redirect to in fname.
  */
-void SendResponse(int clnt_socket, struct http_res * res) {
-    
-    string str;
-    
-    // convert http_res object to string to pass to send() call
-    if (res->response == "200 OK") {
-        str = res->http_version + " " + 
-              res->response + "\r\nServer: " + 
-              res->server + "\r\nLast-modified:" + 
-              res->last_modified + "\r\nContent-type:" + 
-              res->content_type + "\r\nContent-length: " + 
-              to_string(res->content_length) + "\r\n\r\n";
+int CheckFile(string doc_root, string uri, char * fname, char * clntName) {
+
+    PROBE1(check__entry, uri.c_str());
+    int response_code = CheckPath(doc_root, uri, fname, clntName);
+    PROBE2(check__return, response_code, fname);
+    return response_code;
+}
+
+
+static size_t AppendSpan(char * buffer, size_t pos, struct hdr_span span) {
+
+    memcpy(buffer + pos, span.data, span.len);
+    return pos + span.len;
+}
+
+
+static size_t AppendStr(char * buffer, size_t pos, const char * str) {
+
+    size_t len = strlen(str);
+    memcpy(buffer + pos, str, len);
+    return pos + len;
+}
+
+
+/*
+ *  Serialize the entity header fields of a response, i.e. everything
+ *  after the Connection line, including the blank line ending the header.
+ *  buffer must hold HDR_MAX bytes. Returns the number of bytes written.
+ */
+size_t SerializeFields(struct http_res * res, char * buffer) {
+
+    PROBE1(fields__entry, res->code);
+    size_t pos = 0;
+    char num[24];
+
+    if (res->code == RESP_OK) {
+        // generated content (listings) has no modification time
+        if (res->last_modified != -1) {
+            pos = AppendSpan(buffer, pos, LastModifiedHeader(res->last_modified));
+        }
+        pos = AppendStr(buffer, pos, "Content-Type: ");
+        pos = AppendStr(buffer, pos, res->content_type);
+        pos = AppendStr(buffer, pos, "\r\n");
+        if (res->content_encoding != NULL) {
+            pos = AppendStr(buffer, pos, "Content-Encoding: ");
+            pos = AppendStr(buffer, pos, res->content_encoding);
+            pos = AppendStr(buffer, pos, "\r\n");
+        }
+        if (res->vary != NULL) {
+            pos = AppendStr(buffer, pos, "Vary: ");
+            pos = AppendStr(buffer, pos, res->vary);
+            pos = AppendStr(buffer, pos, "\r\n");
+        }
+        if (res->chunked) {
+            pos = AppendStr(buffer, pos, "Transfer-Encoding: chunked\r\n\r\n");
+        }
+        else {
+            // digits come out backwards, so fill num from the end
+            char * p = num + sizeof(num);
+            unsigned long long len = res->content_length;
+            do {
+                *--p = '0' + len % 10;
+                len /= 10;
+            } while (len != 0);
+            pos = AppendStr(buffer, pos, "Content-Length: ");
+            memcpy(buffer + pos, p, num + sizeof(num) - p);
+            pos += num + sizeof(num) - p;
+            pos = AppendStr(buffer, pos, "\r\n\r\n");
+        }
+    }
+    else if (res->code == RESP_MOVED) {
+        pos = AppendStr(buffer, pos, "Location: ");
+        pos = AppendStr(buffer, pos, res->location.c_str());
+        pos = AppendStr(buffer, pos, "\r\nContent-Length: 0\r\n\r\n");
     }
     else {
-        str = res->http_version + " " + 
-              res->response + "\r\nServer: " + 
-              res->server + "\r\n\r\n";
+        pos = AppendStr(buffer, pos, "Content-Length: 0\r\n\r\n");
     }
+    PROBE1(fields__return, pos);
+    return pos;
+}
 
-    // print response just to make sure everything is kosher
-    cerr << "\r\nResponse:\r\n" << str << endl;
 
-    // get header size
-    int hsize = str.length();
-    ssize_t total_bytes_sent = 0;
+/*
+ *  Serialize a complete response header into buffer (HDR_MAX bytes).
+ */
+size_t SerializeResponse(struct http_res * res, char * buffer) {
+
+    PROBE1(serialize__entry, res->code);
+    size_t pos = 0;
+    pos = AppendSpan(buffer, pos, StatusLine(res->code));
+    pos = AppendSpan(buffer, pos, ServerHeader());
+    pos = AppendSpan(buffer, pos, DateHeader());
+    pos = AppendSpan(buffer, pos, ConnectionHeader(res->close));
+    pos += SerializeFields(res, buffer + pos);
+    PROBE1(serialize__return, pos);
+    return pos;
+}
+
+
+/*
+ *  SerializeFields as a string, for storing precomputed headers.
+ */
+string ResponseFields(struct http_res * res) {
+
+    char buffer[HDR_MAX];
+    return string(buffer, SerializeFields(res, buffer));
+}
+
+
+/*
+ *  Send len bytes of buffer, retrying short sends.
+ *  Returns 0 on success, -1 if send() failed.
+ */
+int SendAll(int clnt_socket, const char * buffer, size_t len) {
+
+    PROBE2(sendall__entry, clnt_socket, len);
+    size_t total_bytes_sent = 0;
     
-    // send header
-    while (total_bytes_sent < hsize) {
-        ssize_t num_bytes_sent = send(clnt_socket, 
-                                      str.c_str() + total_bytes_sent, 
-                                      hsize - total_bytes_sent,
-                                      0);
+    while (total_bytes_sent < len) {
+        ssize_t num_bytes_sent = ConnSend(clnt_socket, 
+                                          buffer + total_bytes_sent, 
+                                          len - total_bytes_sent);
+        FlightSyscall(FLIGHT_SYS_SEND);
+        if (num_bytes_sent < 0 && errno == EINTR) {
+            continue;
+        }
         if (num_bytes_sent < 0) {
             cerr << "send() failed" << endl;
-            return;
+            PROBE2(sendall__return, clnt_socket, -1);
+            return -1;
         }
         else if (num_bytes_sent == 0) {
             cerr << "send() failed to send anything" << endl;
         }
         total_bytes_sent += num_bytes_sent;
+        CountBytes(num_bytes_sent);
+    }
+    PROBE2(sendall__return, clnt_socket, 0);
+    return 0;
+}
+
+
+/*
+ *  Send bytes [offset, end) of fd with sendfile().
+ *  Returns 0 on success, -1 if sendfile() failed.
+ */
+static int SendFileRange(int clnt_socket, int fd, off_t offset, off_t end) {
+
+    PROBE2(sendfile__entry, clnt_socket, end - offset);
+    while (offset < end) {
+        ssize_t n = ConnSendfile(clnt_socket, fd, &offset, end - offset);
+        FlightSyscall(FLIGHT_SYS_SENDFILE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            cerr << "sendfile() failed" << endl;
+            PROBE2(sendfile__return, clnt_socket, -1);
+            return -1;
+        }
+        CountBytes(n);
     }
+    PROBE2(sendfile__return, clnt_socket, 0);
+    return 0;
+}
 
-    // get filesize
-    struct stat sb;
-    stat((res->fname).c_str(), &sb);
+
+/*
+ *  Sends a response back to the client
+ */
+void SendResponse(int clnt_socket, struct http_res * res) {
     
+    PROBE2(send__entry, clnt_socket, res->code);
+    char buffer[HDR_MAX];
+    size_t hsize = SerializeResponse(res, buffer);
+
+    // print response just to make sure everything is kosher
+    cerr << "\r\nResponse:\r\n" << string(buffer, hsize) << endl;
+
+    // send header
+    FlightStage(FLIGHT_HEADER);
+    if (SendAll(clnt_socket, buffer, hsize) != 0) {
+        PROBE1(send__return, clnt_socket);
+        return;
+    }
+
     // send file
-    if (res->response.substr(0,3).compare("200") == 0) {
+    if (res->code == RESP_OK) {
+        FlightStage(FLIGHT_BODY);
+        FlightSyscall(FLIGHT_SYS_OPEN);
         int fd = open((res->fname).c_str(), O_RDONLY);
-        sendfile(clnt_socket, fd, NULL, sb.st_size);
+        if (fd < 0) {
+            cerr << "open() failed for " << res->fname << endl;
+            PROBE1(send__return, clnt_socket);
+            return;
+        }
+        SendFileRange(clnt_socket, fd, 0, res->content_length);
+        close(fd);
+    }
+    PROBE1(send__return, clnt_socket);
+}
+
+
+static int AcceptsGzip(struct http_req * req) {
+
+    for (int i = 0; i < req->num_kvs; i++) {
+        if (req->kv[i].key.compare("Accept-Encoding") == 0 &&
+            req->kv[i].val.find("gzip") != string::npos) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ *  Check clntName against the .htaccess rules packed with entry e.
+ *  Returns 0 if it may have the file.
+ */
+static int CheckArchivePermissions(const struct archive_entry * e, char * clntName) {
+
+    if (e->acl_len == 0) {
+        return 0;
+    }
+    istringstream rules(string(site.base + e->acl_off, e->acl_len));
+    return CheckPermissions(ParsePermissions(rules), clntName);
+}
+
+
+/*
+ *  FindArchivePath, less the probes.
+ */
+static int LookupArchivePath(string uri, char * clntName, const struct archive_entry ** e,
+                             string & location) {
+
+    int moved = 0;
+    *e = FindArchiveEntry(&site, uri);
+    if (*e == NULL && !uri.empty() && uri[uri.length() - 1] == '/') {
+        *e = FindArchiveEntry(&site, uri + "index.html");
+    }
+    else if (*e == NULL) {
+        *e = FindArchiveEntry(&site, uri + "/index.html");
+        moved = 1;
+    }
+    if (*e == NULL) {
+        return RESP_NOTFOUND;
+    }
+    if (CheckArchivePermissions(*e, clntName) != 0) {
+        return RESP_FORBIDDEN;
+    }
+    if (moved) {
+        // the Location field has to fit in the response header
+        if (uri.length() >= HDR_MAX / 2 || uri.find_first_of("\r\n") != string::npos) {
+            return RESP_NOTFOUND;
+        }
+        location = uri + "/";
+        return RESP_MOVED;
+    }
+    return RESP_OK;
+}
+
+
+/*
+ *  Look req's uri up in the archive the way CheckFile looks it up on disk:
+ *  "dir/" is its index.html, and "dir" with an index.html is RESP_MOVED,
+ *  with the URI to redirect to in location. There are no listings in
+ *  archive mode, so any other directory is RESP_NOTFOUND. Sets *e for
+ *  RESP_OK and returns the response code.
+ */
+static int FindArchivePath(string uri, char * clntName, const struct archive_entry ** e,
+                           string & location) {
+
+    PROBE1(archivepath__entry, uri.c_str());
+    int response_code = LookupArchivePath(uri, clntName, e, location);
+    PROBE1(archivepath__return, response_code);
+    return response_code;
+}
+
+
+/*
+ *  Sends a response for req out of the packed archive. The header fields
+ *  were serialized at pack time, the body goes out with sendfile() from
+ *  its offset in the archive fd. Returns the response code sent.
+ */
+int SendArchiveResponse(int clnt_socket, struct http_req * req, char * clntName, int close) {
+
+    PROBE2(archive__entry, clnt_socket, req->uri.c_str());
+    const struct archive_entry * e;
+    string location;
+    int response_code = FindArchivePath(req->uri, clntName, &e, location);
+
+    // use the precompressed variant if there is one and the client takes it
+    int gzip = response_code == RESP_OK && e->gz_hdr_off != 0 && AcceptsGzip(req);
+    char buffer[HDR_MAX * 2];
+    size_t pos = 0;
+    pos = AppendSpan(buffer, pos, StatusLine(RESP_OK));
+    pos = AppendSpan(buffer, pos, ServerHeader());
+    pos = AppendSpan(buffer, pos, DateHeader());
+    pos = AppendSpan(buffer, pos, ConnectionHeader(close));
+    struct hdr_span fields = { NULL, 0 };
+    if (response_code == RESP_OK) {
+        fields.data = site.base + (gzip ? e->gz_hdr_off : e->hdr_off);
+        fields.len = gzip ? e->gz_hdr_len : e->hdr_len;
+        if (pos + fields.len > sizeof(buffer)) {
+            cerr << "archive header too long" << endl;
+            response_code = RESP_SERROR;
+        }
+    }
+    if (response_code != RESP_OK) {
+        struct http_res res = BuildHttpResponse(response_code, location);
+        res.close = close;
+        SendResponse(clnt_socket, &res);
+        PROBE1(archive__return, response_code);
+        return response_code;
+    }
+    pos = AppendSpan(buffer, pos, fields);
+    cerr << "\r\nResponse:\r\n" << string(buffer, pos) << endl;
+    FlightStage(FLIGHT_HEADER);
+    if (SendAll(clnt_socket, buffer, pos) != 0) {
+        PROBE1(archive__return, RESP_OK);
+        return RESP_OK;
+    }
+
+    FlightStage(FLIGHT_BODY);
+    off_t offset = gzip ? e->gz_off : e->body_off;
+    SendFileRange(clnt_socket, site.fd, offset, offset + (gzip ? e->gz_len : e->body_len));
+    PROBE1(archive__return, RESP_OK);
+    return RESP_OK;
+}
+
+
+/*
+ *  CheckFile hands back directories to list with a trailing '/'.
+ */
+static int IsListing(const char * fname) {
+
+    size_t len = strlen(fname);
+    return len > 0 && fname[len - 1] == '/';
+}
+
+
+/*
+ *  JSON if the client asks for it, HTML otherwise.
+ */
+static int ListingFormat(struct http_req * req) {
+
+    for (int i = 0; i < req->num_kvs; i++) {
+        if (req->kv[i].key.compare("Accept") == 0 &&
+            req->kv[i].val.find("application/json") != string::npos) {
+            return DIRLIST_JSON;
+        }
+    }
+    return DIRLIST_HTML;
+}
+
+
+static struct http_res ListingResponse(struct dir_listing * l) {
+
+    // start from an empty response, there is no file to stat
+    struct http_res res = BuildHttpResponse(RESP_NOTFOUND, "");
+    res.code = RESP_OK;
+    res.content_type = ListingType(l->format);
+    res.content_length = l->length;
+    res.chunked = !l->done;
+    return res;
+}
+
+
+/*
+ *  Sends the listing of directory path for req. A cached listing, or one
+ *  that fits in a single batch, goes out with a Content-Length; a bigger
+ *  one is sent a chunk per batch while it is rendered. Returns the
+ *  response code sent.
+ */
+int SendListing(int clnt_socket, struct http_req * req, string doc_root, string path, int close) {
+
+    PROBE2(listing__entry, clnt_socket, path.c_str());
+    struct dir_listing l;
+    if (OpenListing(doc_root, path, req->uri, ListingFormat(req), &l) != 0) {
+        struct http_res res = BuildHttpResponse(RESP_SERROR, "");
+        res.close = close;
+        SendResponse(clnt_socket, &res);
+        PROBE1(listing__return, RESP_SERROR);
+        return RESP_SERROR;
+    }
+
+    struct http_res res = ListingResponse(&l);
+    res.close = close;
+    char buffer[HDR_MAX];
+    size_t hsize = SerializeResponse(&res, buffer);
+    cerr << "\r\nResponse:\r\n" << string(buffer, hsize) << endl;
+    FlightStage(FLIGHT_HEADER);
+    if (SendAll(clnt_socket, buffer, hsize) != 0) {
+        CloseListing(&l);
+        PROBE1(listing__return, RESP_OK);
+        return RESP_OK;
+    }
+    FlightStage(FLIGHT_BODY);
+    if (!res.chunked) {
+        SendFileRange(clnt_socket, l.fd, 0, l.length);
+        CloseListing(&l);
+        PROBE1(listing__return, RESP_OK);
+        return RESP_OK;
+    }
+
+    off_t sent = 0;
+    while (1) {
+        if (l.length > sent) {
+            char size[24];
+            int n = snprintf(size, sizeof(size), "%llx\r\n", (unsigned long long)(l.length - sent));
+            if (SendAll(clnt_socket, size, n) != 0 ||
+                SendFileRange(clnt_socket, l.fd, sent, l.length) != 0 ||
+                SendAll(clnt_socket, "\r\n", 2) != 0) {
+                break;
+            }
+            sent = l.length;
+        }
+        if (l.done) {
+            SendAll(clnt_socket, "0\r\n\r\n", 5);
+            break;
+        }
+        if (NextListing(&l) != 0) {
+            // the status is out already; cut the connection so the client
+            // sees the listing end without its last chunk
+            shutdown(clnt_socket, SHUT_RDWR);
+            break;
+        }
+    }
+    CloseListing(&l);
+    PROBE1(listing__return, RESP_OK);
+    return RESP_OK;
+}
+
+
+/*
+ *  ResolveResponse for a directory listing. The whole listing is rendered
+ *  first; the body is a dup of its memfd, so it outlives the cache entry.
+ */
+static int ResolveListing(struct http_req * req, string doc_root, string path, char * fields,
+                          size_t * fields_len, struct http_body * body) {
+
+    PROBE1(resolvelisting__entry, path.c_str());
+    struct dir_listing l;
+    int rc = OpenListing(doc_root, path, req->uri, ListingFormat(req), &l);
+    while (rc == 0 && !l.done) {
+        rc = NextListing(&l);
+    }
+    struct http_res res = ListingResponse(&l);
+    if (rc == 0) {
+        body->fd = fcntl(l.fd, F_DUPFD_CLOEXEC, 0);
+    }
+    if (body->fd < 0) {
+        res = BuildHttpResponse(RESP_SERROR, "");
+    }
+    else {
+        body->own_fd = 1;
+        body->length = l.length;
+    }
+    CloseListing(&l);
+    *fields_len = SerializeFields(&res, fields);
+    PROBE1(resolvelisting__return, res.code);
+    return res.code;
+}
+
+
+/*
+ *  Resolve req the way HandleTCPClient would, for framings that write the
+ *  status and header themselves (see http2.h). The entity header fields
+ *  go into fields (HDR_MAX bytes) in HTTP/1.1 form, ending with the blank
+ *  line, and body says where the content is. Returns the response code.
+ */
+int ResolveResponse(string doc_root, struct http_req * req, char * clntName,
+                    char * fields, size_t * fields_len, struct http_body * body) {
+
+    PROBE1(resolve__entry, req->uri.c_str());
+    body->fd = -1;
+    body->own_fd = 0;
+    body->offset = 0;
+    body->length = 0;
+
+    int response_code = RESP_CERROR;
+    char fname[PATH_MAX];
+    memset(fname, 0, PATH_MAX);
+    if (req->valid && use_archive) {
+        const struct archive_entry * e;
+        string location;
+        response_code = FindArchivePath(req->uri, clntName, &e, location);
+        if (response_code == RESP_MOVED) {
+            // as from CheckFile, the URI to redirect to is in fname
+            strcpy(fname, location.c_str());
+        }
+        if (response_code == RESP_OK) {
+            int gzip = e->gz_hdr_off != 0 && AcceptsGzip(req);
+            size_t len = gzip ? e->gz_hdr_len : e->hdr_len;
+            if (len <= HDR_MAX) {
+                memcpy(fields, site.base + (gzip ? e->gz_hdr_off : e->hdr_off), len);
+                *fields_len = len;
+                body->fd = site.fd;
+                body->offset = gzip ? e->gz_off : e->body_off;
+                body->length = gzip ? e->gz_len : e->body_len;
+                PROBE1(resolve__return, RESP_OK);
+                return RESP_OK;
+            }
+            response_code = RESP_SERROR;
+        }
+    }
+
+    if (req->valid && !use_archive) {
+        response_code = CheckFile(doc_root, req->uri, fname, clntName);
     }
+    if (response_code == RESP_OK && IsListing(fname)) {
+        response_code = ResolveListing(req, doc_root, fname, fields, fields_len, body);
+        PROBE1(resolve__return, response_code);
+        return response_code;
+    }
+    struct http_res res = BuildHttpResponse(response_code, string(fname));
+    if (res.code == RESP_OK) {
+        body->fd = open(fname, O_RDONLY | O_CLOEXEC);
+        if (body->fd < 0) {
+            cerr << "open() failed for " << fname << endl;
+            res = BuildHttpResponse(RESP_NOTFOUND, "");
+        }
+        else {
+            body->own_fd = 1;
+            body->length = res.content_length;
+        }
+    }
+    *fields_len = SerializeFields(&res, fields);
+    PROBE1(resolve__return, res.code);
+    return res.code;
 }
 
 
@@ -478,12 +1054,13 @@ void SendResponse(int clnt_socket, struct http_res * res) {
  *  Handles a resource request from a client and sends a response
  *  containing the requested resource
  */ 
-void HandleTCPClient (int clnt_socket, string doc_root, char * clntName) {
+void HandleTCPClient (int clnt_socket, string doc_root, char * clntName, int tls) {
    
     char http_msg[BUFSIZE];
     char fname[PATH_MAX];
     int sock_open = 1;
     
+    PROBE2(conn__start, clnt_socket, tls);
     // set socket timeout. default 5 seconds.
     struct timeval timeout;
     timeout.tv_sec = SOCK_TIMEOUT;
@@ -494,40 +1071,59 @@ void HandleTCPClient (int clnt_socket, string doc_root, char * clntName) {
         cerr << "socket option failed" << endl;
     }
 
+    // the handshake is bounded by the same timeout
+    if (tls && TLSAccept(clnt_socket) != 0) {
+        close(clnt_socket);
+        PROBE1(conn__done, clnt_socket);
+        return;
+    }
+    // trace id if this connection was sampled for capture, else 0
+    uint64_t trace = CaptureOpen();
+
     while (sock_open != 0) {
         memset(fname, 0, PATH_MAX);
         // Receive incoming HTTP message
         ssize_t num_bytes_rcvd = RecvHttpMessage(clnt_socket, http_msg);
         if (num_bytes_rcvd == 0) {
             cerr << "failed to receive http message" << endl;
+            CaptureClose(trace);
+            ConnClose(clnt_socket);
+            PROBE1(conn__done, clnt_socket);
             return;
         }
         else {
             cerr << "\r\nRequest:\r\n" << http_msg << endl;
         }
+        // HTTP/2 with prior knowledge opens with the connection preface
+        if (!tls && IsHttp2Preface(http_msg, num_bytes_rcvd)) {
+            CaptureClose(trace);
+            ServeHttp2(clnt_socket, doc_root, clntName, http_msg, num_bytes_rcvd, NULL);
+            ConnClose(clnt_socket);
+            PROBE1(conn__done, clnt_socket);
+            return;
+        }
+        CaptureData(trace, http_msg, num_bytes_rcvd);
+        uint64_t bytes_before = my_stats->bytes_sent.load(memory_order_relaxed);
         // Parse the message into a request object
+        FlightStage(FLIGHT_PARSE);
         struct http_req req = ParseHttpMessage(http_msg);
-        int response_code;
-        if (req.valid == 0) {
-            response_code = RESP_CERROR;
-        }
-        else {
-            // Check that the requested resource is available
-            response_code = CheckFile(doc_root, req.uri, fname, clntName);
+        FlightRequest(req.method.c_str(), req.uri.c_str());
+        PROBE2(request__start, clnt_socket, req.uri.c_str());
+        if (!tls && IsH2cUpgrade(&req)) {
+            CaptureResponse(trace, 101, strlen(H2C_SWITCHING));
+            CaptureClose(trace);
+            ServeHttp2(clnt_socket, doc_root, clntName, NULL, 0, &req);
+            ConnClose(clnt_socket);
+            PROBE1(conn__done, clnt_socket);
+            return;
         }
-        // Create a response with the requested resource
-        struct http_res res = BuildHttpResponse(response_code, string(fname));
-        // Send the response back to the client
-        SendResponse(clnt_socket, &res);
+        // Does the client want the connection closed after this response?
+        // Once an upgrade is pending we close after every response.
+        int close_conn = UpgradePending();
         for (int i = 0; i < req.num_kvs; i++) {
             if (req.kv[i].key.compare("Connection") == 0) {
                 if (req.kv[i].val.compare(" close") == 0) {
-                    cerr << "Closing socket..." << endl;
-                    sock_open = 0;
-                    if (close(clnt_socket) != 0) {
-                        cerr << "Close failed errno: " << errno << endl;
-                    }
-                    sock_open = 0;
+                    close_conn = 1;
                     break;
                 }
                 else {
@@ -535,61 +1131,177 @@ void HandleTCPClient (int clnt_socket, string doc_root, char * clntName) {
                 }
             }
         }
+        int response_code;
+        int sent = 0;
+        FlightStage(FLIGHT_RESOLVE);
+        if (req.valid == 0) {
+            response_code = RESP_CERROR;
+        }
+        else if (use_archive) {
+            response_code = SendArchiveResponse(clnt_socket, &req, clntName, close_conn);
+            sent = 1;
+        }
+        else {
+            // Check that the requested resource is available
+            response_code = CheckFile(doc_root, req.uri, fname, clntName);
+            if (response_code == RESP_OK && IsListing(fname)) {
+                response_code = SendListing(clnt_socket, &req, doc_root, fname, close_conn);
+                sent = 1;
+            }
+        }
+        if (!sent) {
+            // Create a response with the requested resource
+            struct http_res res = BuildHttpResponse(response_code, string(fname));
+            res.close = close_conn;
+            // Send the response back to the client
+            SendResponse(clnt_socket, &res);
+            response_code = res.code;
+        }
+        uint64_t bytes = my_stats->bytes_sent.load(memory_order_relaxed) - bytes_before;
+        CountRequest(response_code);
+        CaptureResponse(trace, response_code, bytes);
+        FlightEnd(response_code, bytes);
+        PROBE3(request__done, clnt_socket, response_code, bytes);
+        if (close_conn) {
+            CaptureClose(trace);
+            cerr << "Closing socket..." << endl;
+            sock_open = 0;
+            if (ConnClose(clnt_socket) != 0) {
+                cerr << "Close failed errno: " << errno << endl;
+            }
+        }
     }
+    PROBE1(conn__done, clnt_socket);
+}
+
+
+static void HandleSighup(int) {
+    reload_archive = 1;
 }
 
 
 /*
- *  Start the server
+ *  Swap in the archive currently at site.path, keeping the old one
+ *  if the new one fails to open.
  */
-void start_httpd(unsigned short port, string doc_root)
-{
-    cerr << "Starting server (port: " << port <<
-            ", doc_root: " << doc_root << ")" << endl;
+static void ReloadArchive() {
 
-    // create connection socket
-    int fd;
-    if ((fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-        cerr << "socket() failed" << endl;
+    struct site_archive fresh;
+    reload_archive = 0;
+    if (OpenSiteArchive(site.path, &fresh) != 0) {
+        cerr << "keeping previous archive" << endl;
         return;
     }
-    
-    struct sockaddr_in servAddr;
-    memset(&servAddr, 0, sizeof(servAddr));
-    servAddr.sin_family = AF_INET;
-    servAddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servAddr.sin_port = htons(port);
-    
-    int t1 = bind(fd, (struct sockaddr*) &servAddr, sizeof(servAddr));
-    if (t1 < 0) {
-        cerr << "bind() failed " << endl;
-        return;
+    CloseSiteArchive(&site);
+    site = fresh;
+    cerr << "reloaded archive " << site.path << endl;
+}
+
+
+/*
+ *  Format a client's address for logging and CheckPermissions. .htaccess
+ *  rules are IPv4, so IPv4 clients of a dual-stack listener are shown as
+ *  dotted quads rather than v4-mapped IPv6.
+ */
+static const char * ClientName(struct sockaddr_storage * addr, char * name, size_t len,
+                               unsigned short * port) {
+
+    if (addr->ss_family == AF_INET6) {
+        struct sockaddr_in6 * sin6 = (struct sockaddr_in6 *)addr;
+        *port = ntohs(sin6->sin6_port);
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr)) {
+            return inet_ntop(AF_INET, &sin6->sin6_addr.s6_addr[12], name, len);
+        }
+        return inet_ntop(AF_INET6, &sin6->sin6_addr, name, len);
     }
+    struct sockaddr_in * sin = (struct sockaddr_in *)addr;
+    *port = ntohs(sin->sin_port);
+    return inet_ntop(AF_INET, &sin->sin_addr, name, len);
+}
 
-    int t2 = listen(fd, MAXPENDING);
-    if (t2 < 0) {
-        cerr << "listen() failed " << endl;
-        return;
+
+/*
+ *  Accept and serve connections on fd (and the HTTPS listener, if there
+ *  is one) until an upgrade drains us. This is the whole server in
+ *  single-process mode and the body of every worker in prefork mode.
+ */
+void ServeConnections(int fd, string doc_root)
+{
+    if (use_archive) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = HandleSighup;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGHUP, &sa, NULL);
     }
+    InstallUpgradeHandler();
+
+    // the signals the loop acts on are held off from checking their flags
+    // until ppoll() waits, so one arriving in between can't go unnoticed
+    sigset_t held, waiting;
+    sigemptyset(&held);
+    sigaddset(&held, SIGUSR1);
+    sigaddset(&held, SIGUSR2);
+    sigaddset(&held, SIGHUP);
+    sigprocmask(SIG_BLOCK, NULL, &waiting);
+    sigdelset(&waiting, SIGUSR1);
+    sigdelset(&waiting, SIGUSR2);
+    sigdelset(&waiting, SIGHUP);
+
+    struct pollfd pfds[2];
+    pfds[0].fd = fd;
+    pfds[1].fd = tls_listen_fd;
+    pfds[0].events = pfds[1].events = POLLIN;
+    int nfds = tls_listen_fd >= 0 ? 2 : 1;
+    int turn = 0;
 
     // wait for incoming connections
     while (1) {
-        struct sockaddr_in clntAddr;
+        sigprocmask(SIG_BLOCK, &held, NULL);
+        if (CheckUpgrade()) {
+            sigprocmask(SIG_SETMASK, &waiting, NULL);
+            break;
+        }
+        if (reload_archive) {
+            ReloadArchive();
+        }
+        CheckStats();
+        int rc = ppoll(pfds, nfds, NULL, &waiting);
+        sigprocmask(SIG_SETMASK, &waiting, NULL);
+        if (rc < 0) {
+            if (errno != EINTR) {
+                cerr << "poll() failed " << endl;
+            }
+            continue;
+        }
+        // with two listeners, take turns when both have connections queued
+        if (nfds == 2) {
+            turn = (pfds[turn ^ 1].revents & POLLIN) ? turn ^ 1 : turn;
+        }
+        int listen_fd = pfds[turn].fd;
+
+        struct sockaddr_storage clntAddr;
         memset(&clntAddr, 0, sizeof(clntAddr));
         
         socklen_t clntAddrLen = sizeof(clntAddr);
-        int clntSock = accept(fd, (struct sockaddr *) &clntAddr, &clntAddrLen);
+        // client sockets must not leak into an upgraded binary
+        int clntSock = accept4(listen_fd, (struct sockaddr *) &clntAddr, &clntAddrLen, SOCK_CLOEXEC);
+        if (clntSock < 0 && (errno == EAGAIN || errno == EINTR)) {
+            // another worker got there first
+            continue;
+        }
         if (clntSock < 0) {
             cerr << "accept() failed " << endl;
             continue;
         }
+        CountConnection();
         
-        char clntName[INET_ADDRSTRLEN];
-        if (inet_ntop(AF_INET, &clntAddr.sin_addr.s_addr, 
-                      clntName, sizeof(clntName)) != NULL) {
+        char clntName[INET6_ADDRSTRLEN];
+        unsigned short clntPort;
+        if (ClientName(&clntAddr, clntName, sizeof(clntName), &clntPort) != NULL) {
             cout << "*****************************************" << endl;
-            cout << "Handling client " << clntName << " " << ntohs(clntAddr.sin_port) << endl;
-            HandleTCPClient(clntSock, doc_root, clntName);
+            cout << "Handling client " << clntName << " " << clntPort << endl;
+            HandleTCPClient(clntSock, doc_root, clntName, listen_fd == tls_listen_fd);
         }
         else {
             cerr << "Unable to get client address" << endl;
@@ -598,3 +1310,83 @@ void start_httpd(unsigned short port, string doc_root)
         cout << "*****************************************\r\n" << endl;
     }
 }
+
+
+/*
+ *  Start the server. Returns 0 once it has shut down, -1 if it could not
+ *  be started.
+ */
+int start_httpd(unsigned short port, string doc_root, struct httpd_conf * conf)
+{
+    cerr << "Starting server (port: " << port <<
+            ", doc_root: " << doc_root << ")" << endl;
+
+    // a client hanging up mid-response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
+    // a regular file instead of a directory is a packed site archive
+    if (IsSiteArchive(doc_root)) {
+        if (OpenSiteArchive(doc_root, &site) != 0) {
+            return -1;
+        }
+        use_archive = 1;
+    }
+
+    dir_listings = conf->listings;
+
+    if (conf->tls_port != 0 && InitTLS(conf->tls_cert, conf->tls_key) != 0) {
+        return -1;
+    }
+
+    // take over the listening sockets of an upgrading server, if any
+    int fds[2];
+    int inherited = InheritListeners(fds, 2);
+    if (inherited < 0) {
+        return -1;
+    }
+    int fd = inherited > 0 ? fds[0] : OpenListenSocket(port, &conf->sock);
+    if (fd < 0) {
+        return -1;
+    }
+    if (inherited > 0) {
+        // the profile may have changed along with the binary
+        TuneListener(fd, &conf->sock);
+    }
+    if (conf->tls_port != 0) {
+        tls_listen_fd = inherited > 1 ? fds[1] : OpenListenSocket(conf->tls_port, &conf->sock);
+        if (tls_listen_fd < 0) {
+            return -1;
+        }
+        if (inherited > 1) {
+            TuneListener(tls_listen_fd, &conf->sock);
+        }
+        fcntl(tls_listen_fd, F_SETFL, fcntl(tls_listen_fd, F_GETFL) | O_NONBLOCK);
+        cerr << "HTTPS on port " << conf->tls_port << endl;
+    }
+    else if (inherited > 1) {
+        close(fds[1]);
+    }
+    // every process polls the listeners, and a connection another one took
+    // must not leave us blocked in accept()
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    RegisterListener(fd);
+    if (tls_listen_fd >= 0) {
+        RegisterListener(tls_listen_fd);
+    }
+
+    if (conf->capture != NULL && OpenCapture(conf->capture, conf->capture_sample) != 0) {
+        return -1;
+    }
+    if (conf->slow_ms >= 0 &&
+        OpenFlightRecorder(conf->slow_log != NULL ? conf->slow_log : FLIGHT_LOG, conf->slow_ms) != 0) {
+        return -1;
+    }
+
+    if (conf->workers > 0 || conf->numa) {
+        return RunPrefork(fd, doc_root, conf->workers, conf->numa);
+    }
+    InstallStatsHandler();
+    UpgradeReady();
+    ServeConnections(fd, doc_root);
+    return 0;
+}
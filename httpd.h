@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <fcntl.h>
 #include <errno.h>
 #include <limits.h>
@@ -20,8 +21,10 @@
 #include <vector>
 #include <algorithm>
 #include "common.h"
+#include "sockopt.h"
 
 #define RESP_OK         200
+#define RESP_MOVED      301
 #define RESP_APPEND_OK  302
 #define RESP_CERROR     400
 #define RESP_FORBIDDEN  403
@@ -31,19 +34,50 @@
 #define SERV_VER        "HTTP/1.1"
 #define SERV_NAME       "Custom/0.1"
 
+typedef struct httpd_conf {
+    int workers;        // prefork workers, 0 serves from this process
+    int numa;           // one prefork worker per NUMA node
+    const char * capture;       // trace file for sampled connections
+    int capture_sample;         // capture 1 in this many connections
+    unsigned short tls_port;    // HTTPS listener, 0 for none
+    const char * tls_cert;      // PEM certificate chain
+    const char * tls_key;       // PEM private key, NULL if in tls_cert
+    int listings;               // list directories without an index.html
+    int slow_ms;                // log requests this slow, -1 for none
+    const char * slow_log;      // where, NULL for FLIGHT_LOG
+    struct sock_profile sock;   // listener socket options
+} httpd_conf;
+
+// where a response's content comes from, see ResolveResponse
+typedef struct http_body {
+    int fd;             // -1 if there is no body
+    int own_fd;         // close fd when done; not set for the archive fd
+    off_t offset;
+    off_t length;
+} http_body;
+
 using namespace std;
 
 char * str_to_char(string str);
 void PrintFile(string fname);
 int MatchAddr(string serv_addr, string clnt_addr);
+vector<struct kv_pairs> ParsePermissions(istream & rules);
 vector<struct kv_pairs> GetPermissions(string doc_root);
 int CheckPermissions(vector<struct kv_pairs> perms, char * clnt_addr);
+int UnderRoot(string doc_root, const char * path);
 ssize_t RecvHttpMessage(int clnt_socket, char * buffer);
 struct http_req ParseHttpMessage(char * buffer);
-int CheckFile(string doc_root, string uri, char * clntName);
+int CheckFile(string doc_root, string uri, char * fname, char * clntName);
 struct http_res BuildHttpResponse(int response_code, string fname);
+size_t SerializeFields(struct http_res * res, char * buffer);
+size_t SerializeResponse(struct http_res * res, char * buffer);
+string ResponseFields(struct http_res * res);
+int SendAll(int clnt_socket, const char * buffer, size_t len);
 void SendResponse(int clnt_socket, char * buffer, ssize_t len, char * fname);
-void HandleTCPClient(int clntSocket, string doc_root, char * clntName);
-void start_httpd(unsigned short port, string doc_root);
+int ResolveResponse(string doc_root, struct http_req * req, char * clntName,
+                    char * fields, size_t * fields_len, struct http_body * body);
+void HandleTCPClient(int clntSocket, string doc_root, char * clntName, int tls);
+void ServeConnections(int fd, string doc_root);
+int start_httpd(unsigned short port, string doc_root, struct httpd_conf * conf);
 
 #endif // HTTPD_H
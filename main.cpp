@@ -1,13 +1,240 @@
 #include <iostream>
 #include "httpd.h"
+#include "archive.h"
+#include "hdrcache.h"
+#include "mime.h"
+#include "upgrade.h"
+#include "phash.h"
+#include "tls.h"
+#include "hpack.h"
+#include "http2.h"
+#include "dirlist.h"
+#include "flight.h"
+#include "capture.h"
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+#include <openssl/ssl.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
 
 using namespace std;
 
 void usage(char * argv0)
 {
-    cerr << "Usage: " << argv0 << " listen_port docroot_dir" << endl;
+    cerr << "Usage: " << argv0 << " [-w workers|numa] [-c trace_file [-s sample]]"
+         << " [-t https_port -C cert.pem [-K key.pem]] [-l] [-S slow_ms [-F slow_log]]"
+         << " [-o socket_profile]"
+         << " listen_port docroot_dir|site_archive" << endl;
 }
 
+/*
+ *  Write a throwaway self-signed localhost certificate for the TLS test.
+ */
+static int MakeTestCert(string cert_path, string key_path) {
+
+    EVP_PKEY * pkey = EVP_EC_gen("P-256");
+    X509 * x = X509_new();
+    if (pkey == NULL || x == NULL) {
+        EVP_PKEY_free(pkey);
+        X509_free(x);
+        return -1;
+    }
+    ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+    X509_gmtime_adj(X509_getm_notBefore(x), 0);
+    X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+    X509_set_pubkey(x, pkey);
+    X509_NAME * name = X509_get_subject_name(x);
+    X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0);
+    X509_set_issuer_name(x, name);
+    int rc = X509_sign(x, pkey, EVP_sha256()) > 0 ? 0 : -1;
+
+    FILE * f = fopen(cert_path.c_str(), "w");
+    if (f == NULL || PEM_write_X509(f, x) != 1) {
+        rc = -1;
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    f = fopen(key_path.c_str(), "w");
+    if (f == NULL || PEM_write_PrivateKey(f, pkey, NULL, NULL, 0, NULL, NULL) != 1) {
+        rc = -1;
+    }
+    if (f != NULL) {
+        fclose(f);
+    }
+    X509_free(x);
+    EVP_PKEY_free(pkey);
+    return rc;
+}
+
+
+/*
+ *  Serve one canned response over TLS on the next connection to listen_fd,
+ *  the body going through ConnSendfile. Runs in a child; exits 0 if every
+ *  step worked.
+ */
+static void TLSTestServer(int listen_fd, string body_path) {
+
+    char buffer[BUFSIZE];
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0 || TLSAccept(fd) != 0 || ConnRecv(fd, buffer, sizeof(buffer)) <= 0) {
+        _exit(1);
+    }
+    int body = open(body_path.c_str(), O_RDONLY);
+    struct stat sb;
+    if (body < 0 || fstat(body, &sb) != 0 || SendAll(fd, "HTTP/1.1 200 OK\r\n\r\n", 19) != 0) {
+        _exit(2);
+    }
+    off_t offset = 0;
+    while (offset < sb.st_size) {
+        if (ConnSendfile(fd, body, &offset, sb.st_size - offset) <= 0) {
+            _exit(3);
+        }
+    }
+    ConnClose(fd);
+    _exit(0);
+}
+
+
+/*
+ *  Serve one connection with HandleTCPClient in a child, capturing it to
+ *  trace if that is set. Sends request and returns all that came back
+ *  before the child closed the connection.
+ */
+static string ServeOnce(string doc_root, string request, const char * trace) {
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        return "";
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        char clnt[] = "127.0.0.1";
+        if (trace != NULL && OpenCapture(trace, 1) != 0) {
+            _exit(1);
+        }
+        HandleTCPClient(sv[1], doc_root, clnt, 0);
+        _exit(0);
+    }
+    close(sv[1]);
+    string reply;
+    if (pid > 0 && send(sv[0], request.data(), request.size(), 0) == (ssize_t)request.size()) {
+        char buffer[BUFSIZE];
+        ssize_t n;
+        while ((n = recv(sv[0], buffer, sizeof(buffer), 0)) > 0) {
+            reply.append(buffer, n);
+        }
+    }
+    close(sv[0]);
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+    return reply;
+}
+
+
+/*
+ *  Run ServeHttp2 on one end of a socketpair in a child, as if the preface
+ *  had not been read yet. *fd is the client's end, which gives up on reads
+ *  after a few seconds so a stuck server fails the test, not hangs it.
+ */
+static pid_t StartHttp2(string doc_root, int * fd) {
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        char clnt[] = "127.0.0.1";
+        ServeHttp2(sv[1], doc_root, clnt, "", 0, NULL);
+        _exit(0);
+    }
+    close(sv[1]);
+    struct timeval tv = { 5, 0 };
+    setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    *fd = sv[0];
+    return pid;
+}
+
+
+static string H2Frame(uint8_t type, uint8_t flags, uint32_t stream, string payload) {
+
+    string frame(H2_FRAME_HEADER, '\0');
+    frame[0] = payload.size() >> 16;
+    frame[1] = payload.size() >> 8;
+    frame[2] = payload.size();
+    frame[3] = type;
+    frame[4] = flags;
+    for (int i = 0; i < 4; i++) {
+        frame[5 + i] = stream >> (24 - 8 * i);
+    }
+    return frame + payload;
+}
+
+
+static string H2Uint32(uint32_t value) {
+
+    string out(4, '\0');
+    for (int i = 0; i < 4; i++) {
+        out[i] = value >> (24 - 8 * i);
+    }
+    return out;
+}
+
+
+static string H2Setting(uint16_t id, uint32_t value) {
+
+    string out(2, '\0');
+    out[0] = id >> 8;
+    out[1] = id;
+    return out + H2Uint32(value);
+}
+
+
+/*
+ *  Read the next frame off fd. Returns 0, or -1 on EOF or timeout.
+ */
+static int H2ReadFrame(int fd, uint8_t * type, uint8_t * flags, uint32_t * stream, string & payload) {
+
+    uint8_t hdr[H2_FRAME_HEADER];
+    if (recv(fd, hdr, sizeof(hdr), MSG_WAITALL) != (ssize_t)sizeof(hdr)) {
+        return -1;
+    }
+    size_t len = hdr[0] << 16 | hdr[1] << 8 | hdr[2];
+    *type = hdr[3];
+    *flags = hdr[4];
+    *stream = (hdr[5] << 24 | hdr[6] << 16 | hdr[7] << 8 | hdr[8]) & H2_MAX_WINDOW;
+    payload.assign(len, '\0');
+    if (len > 0 && recv(fd, &payload[0], len, MSG_WAITALL) != (ssize_t)len) {
+        return -1;
+    }
+    return 0;
+}
+
+
+/*
+ *  Ask for path on stream 1 of an HTTP/2 connection.
+ */
+static string H2Request(string path) {
+
+    struct hpack_table encoder;
+    HpackInit(&encoder, HPACK_TABLE_SIZE);
+    vector<struct hpack_field> fields;
+    struct hpack_field method = { ":method", "GET" }, scheme = { ":scheme", "http" },
+                       target = { ":path", path }, authority = { ":authority", "localhost" };
+    fields.push_back(method);
+    fields.push_back(scheme);
+    fields.push_back(target);
+    fields.push_back(authority);
+    string block;
+    HpackEncode(&encoder, fields, block);
+    return H2Frame(H2_HEADERS, H2_END_HEADERS | H2_END_STREAM, 1, block);
+}
+
+
 void runtests() {
 
     int passed = 1;
@@ -134,17 +361,928 @@ void runtests() {
         cerr << "FAILED" << endl;
     }
 
+    cerr << "testing SerializeResponse..." << endl;
+    char hdr_buf[HDR_MAX];
+    string date(hdr_buf, FormatHttpDate(784111777, hdr_buf));
+    if (date != "Sun, 06 Nov 1994 08:49:37 GMT") {
+        cerr << "expected \"Sun, 06 Nov 1994 08:49:37 GMT\" but was: " << date << endl;
+        passed = 0;
+    }
+    struct http_res res = BuildHttpResponse(RESP_NOTFOUND, "");
+    res.close = 1;
+    string hdr(hdr_buf, SerializeResponse(&res, hdr_buf));
+    if (hdr.compare(0, 24, "HTTP/1.1 404 Not Found\r\n") ||
+        hdr.find("\r\nConnection: close\r\n") == string::npos ||
+        hdr.find("\r\nContent-Length: 0\r\n\r\n") != hdr.size() - 23) {
+        cerr << "unexpected 404 header: " << hdr << endl;
+        passed = 0;
+    }
+    // an mtime of 0 is a real date, only -1 means there is none
+    res.code = RESP_OK;
+    res.content_type = "text/plain";
+    res.last_modified = 0;
+    hdr = string(hdr_buf, SerializeResponse(&res, hdr_buf));
+    if (hdr.find("\r\nLast-Modified: Thu, 01 Jan 1970 00:00:00 GMT\r\n") == string::npos) {
+        cerr << "expected a Last-Modified field for mtime 0: " << hdr << endl;
+        passed = 0;
+    }
+    res.last_modified = -1;
+    hdr = string(hdr_buf, SerializeResponse(&res, hdr_buf));
+    if (hdr.find("Last-Modified") != string::npos) {
+        cerr << "unexpected Last-Modified field: " << hdr << endl;
+        passed = 0;
+    }
+    res = BuildHttpResponse(RESP_OK, "/nonexistent/file.html");
+    if (res.code != RESP_NOTFOUND) {
+        cerr << "expected missing file to become a 404 but was: " << res.code << endl;
+        passed = 0;
+    }
+    if (passed) {
+        cerr << "PASSED" << endl;
+        passed = 1;
+    } 
+    else {
+        cerr << "FAILED" << endl;
+    }
+
+    cerr << "testing MimeType..." << endl;
+    const char * mime_tests[][2] = {
+        { "/srv/index.html", "text/html" },
+        { "/srv/PENGUIN.JPEG", "image/jpeg" },
+        { "/srv/a.b/c.png", "image/png" },
+        { "/srv/x.tar.gz", "application/gzip" },
+        { "/srv/app.min.js", "text/javascript" },
+        { "/srv/font.woff2", "font/woff2" },
+        { "/srv.d/README", MIME_DEFAULT },
+        { "/srv/archive.", MIME_DEFAULT },
+        { "/srv/file.nosuchext", MIME_DEFAULT },
+    };
+    for (size_t i = 0; i < sizeof(mime_tests) / sizeof(mime_tests[0]); i++) {
+        if (string(MimeType(mime_tests[i][0])) != mime_tests[i][1]) {
+            cerr << "expected \"" << mime_tests[i][1] << "\" for " << mime_tests[i][0]
+                 << " but was: " << MimeType(mime_tests[i][0]) << endl;
+            passed = 0;
+        }
+    }
+    if (passed) {
+        cerr << "PASSED" << endl;
+        passed = 1;
+    } 
+    else {
+        cerr << "FAILED" << endl;
+    }
+
+    cerr << "testing BuildPerfectHash..." << endl;
+    vector<string> keys;
+    for (int i = 0; i < 500; i++) {
+        keys.push_back("/dir/file" + to_string(i) + ".html");
+    }
+    struct phash_table table;
+    if (BuildPerfectHash(keys, &table) != 0) {
+        cerr << "could not build table for 500 keys" << endl;
+        passed = 0;
+    }
+    else {
+        for (size_t i = 0; i < keys.size(); i++) {
+            uint32_t slot = PHashSlot(&table.disp[0], table.num_buckets, table.table_size,
+                                      keys[i].data(), keys[i].size());
+            if (table.slots[slot] != i + 1) {
+                cerr << "expected " << keys[i] << " in slot " << slot << endl;
+                passed = 0;
+                break;
+            }
+        }
+    }
+    if (passed) {
+        cerr << "PASSED" << endl;
+        passed = 1;
+    } 
+    else {
+        cerr << "FAILED" << endl;
+    }
+
+    cerr << "testing PackSite..." << endl;
+    char pack_dir[] = "/tmp/httpd_pack_XXXXXX";
+    struct site_archive site;
+    if (mkdtemp(pack_dir) == NULL) {
+        cerr << "mkdtemp() failed" << endl;
+        passed = 0;
+    }
+    else {
+        string dir = pack_dir;
+        ofstream((dir + "/a.html").c_str()) << "<html>hello</html>";
+        ofstream((dir + "/big.html").c_str()) << string(4096, 'a');
+        chmod((dir + "/big.html").c_str(), 0644);
+        ofstream((dir + "/.htaccess").c_str()) << "deny from 0.0.0.0/0";
+        ofstream((dir + ".outside").c_str()) << "secret";
+        chmod((dir + "/a.html").c_str(), 0644);
+        chmod((dir + ".outside").c_str(), 0644);
+        // links out of the docroot and link cycles are not followed
+        mkdir((dir + "/sub").c_str(), 0755);
+        symlink("a.html", (dir + "/alias.html").c_str());
+        symlink((dir + ".outside").c_str(), (dir + "/out").c_str());
+        symlink("..", (dir + "/sub/loop").c_str());
+        if (PackSite(dir, dir + ".pack", 1) != 0 || OpenSiteArchive(dir + ".pack", &site) != 0) {
+            cerr << "could not pack " << dir << endl;
+            passed = 0;
+        }
+        else {
+            const struct archive_entry * e = FindArchiveEntry(&site, "/a.html");
+            if (e == NULL || e->body_len != 18 ||
+                string(site.base + e->body_off, e->body_len) != "<html>hello</html>") {
+                cerr << "expected /a.html in archive" << endl;
+                passed = 0;
+            }
+            if (FindArchiveEntry(&site, "/.htaccess") != NULL ||
+                FindArchiveEntry(&site, "/b.html") != NULL ||
+                FindArchiveEntry(&site, "/out") != NULL ||
+                FindArchiveEntry(&site, "/sub/loop/a.html") != NULL ||
+                FindArchiveEntry(&site, "/alias.html") == NULL) {
+                cerr << "unexpected entries in archive" << endl;
+                passed = 0;
+            }
+            // a file with a gzip copy tells caches that both depend on
+            // Accept-Encoding; one without doesn't
+            const struct archive_entry * big = FindArchiveEntry(&site, "/big.html");
+            if (big == NULL || big->gz_hdr_off == 0 ||
+                string(site.base + big->hdr_off, big->hdr_len).find("\r\nVary: Accept-Encoding\r\n") == string::npos ||
+                string(site.base + big->gz_hdr_off, big->gz_hdr_len).find("\r\nVary: Accept-Encoding\r\n") == string::npos ||
+                string(site.base + big->gz_hdr_off, big->gz_hdr_len).find("Content-Encoding: gzip\r\n") == string::npos ||
+                (e != NULL && string(site.base + e->hdr_off, e->hdr_len).find("Vary:") != string::npos)) {
+                cerr << "expected Vary: Accept-Encoding on /big.html only" << endl;
+                passed = 0;
+            }
+            // the .htaccess rules travel with the file
+            char denied[] = "10.1.2.3";
+            char local[] = "127.0.0.1";
+            if (e != NULL) {
+                istringstream rules(string(site.base + e->acl_off, e->acl_len));
+                vector<struct kv_pairs> perms = ParsePermissions(rules);
+                if (CheckPermissions(perms, denied) == 0 || CheckPermissions(perms, local) != 0) {
+                    cerr << "expected /a.html to keep its .htaccess rules" << endl;
+                    passed = 0;
+                }
+            }
+            CloseSiteArchive(&site);
+        }
+        unlink((dir + "/a.html").c_str());
+        unlink((dir + "/big.html").c_str());
+        unlink((dir + "/.htaccess").c_str());
+        unlink((dir + "/alias.html").c_str());
+        unlink((dir + "/out").c_str());
+        unlink((dir + "/sub/loop").c_str());
+        rmdir((dir + "/sub").c_str());
+        unlink((dir + ".outside").c_str());
+        unlink((dir + ".pack").c_str());
+        rmdir(pack_dir);
+    }
+    if (passed) {
+        cerr << "PASSED" << endl;
+        passed = 1;
+    } 
+    else {
+        cerr << "FAILED" << endl;
+    }
+
+    cerr << "testing Capture..." << endl;
+    char cap_dir[] = "/tmp/httpd_cap_XXXXXX";
+    char cap_root[PATH_MAX];
+    if (mkdtemp(cap_dir) == NULL || realpath(cap_dir, cap_root) == NULL) {
+        cerr << "mkdtemp() failed" << endl;
+        passed = 0;
+    }
+    else {
+        string dir = cap_root;
+        string trace_path = dir + "/trace";
+        ofstream((dir + "/a.html").c_str()) << "<html>captured</html>";
+        chmod((dir + "/a.html").c_str(), 0644);
+        string request = "GET /a.html HTTP/1.1\r\nConnection: close\r\n\r\n";
+        string reply = ServeOnce(dir, request, trace_path.c_str());
+        ifstream infile(trace_path.c_str(), ios::binary);
+        string trace((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+        // open, the request, its response and the close, in that order
+        vector<struct trace_rec> recs;
+        string data;
+        size_t pos = 8;
+        while (pos + sizeof(struct trace_rec) <= trace.size()) {
+            struct trace_rec rec;
+            memcpy(&rec, trace.data() + pos, sizeof(rec));
+            pos += sizeof(rec);
+            if (rec.type == TRACE_DATA) {
+                data = trace.substr(pos, rec.len);
+            }
+            pos += rec.len;
+            recs.push_back(rec);
+        }
+        if (trace.compare(0, 8, TRACE_MAGIC) != 0 || recs.size() != 4 ||
+            recs[0].type != TRACE_OPEN || recs[1].type != TRACE_DATA ||
+            recs[2].type != TRACE_RESPONSE || recs[3].type != TRACE_CLOSE ||
+            data != request || recs[2].status != RESP_OK || recs[2].bytes != reply.size()) {
+            cerr << "unexpected trace of " << recs.size() << " records for a "
+                 << reply.size() << " byte reply" << endl;
+            passed = 0;
+        }
+        // replaying the request has to draw the response that was recorded
+        else {
+            string replayed = ServeOnce(dir, data, NULL);
+            uint32_t status = 0;
+            size_t bytes = TraceResponseSize(replayed.data(), replayed.size(), &status);
+            if (status != recs[2].status || bytes != recs[2].bytes || bytes != replayed.size()) {
+                cerr << "replay got " << status << " with " << bytes << " bytes, captured "
+                     << recs[2].status << " with " << recs[2].bytes << endl;
+                passed = 0;
+            }
+        }
+        // big listings are chunked; replay has to find where they end
+        string chunked = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+                         "5\r\nhello\r\n1a\r\nabcdefghijklmnopqrstuvwxyz\r\n0\r\n\r\n";
+        uint32_t status = 0;
+        if (TraceResponseSize(chunked.data(), chunked.size() - 1, &status) != 0 ||
+            TraceResponseSize((chunked + "HTTP/1.1").data(), chunked.size() + 8, &status) != chunked.size() ||
+            status != RESP_OK) {
+            cerr << "expected a chunked response to end after its last chunk" << endl;
+            passed = 0;
+        }
+        unlink(trace_path.c_str());
+        unlink((dir + "/a.html").c_str());
+        rmdir(cap_dir);
+    }
+    if (passed) {
+        cerr << "PASSED" << endl;
+        passed = 1;
+    } 
+    else {
+        cerr << "FAILED" << endl;
+    }
+
+    cerr << "testing HpackDecode..." << endl;
+    // RFC 7541 C.4.1 and C.4.2: Huffman coded requests sharing a table
+    const uint8_t first_block[] = {
+        0x82, 0x86, 0x84, 0x41, 0x8c, 0xf1, 0xe3, 0xc2, 0xe5, 0xf2, 0x3a, 0x6b,
+        0xa0, 0xab, 0x90, 0xf4, 0xff
+    };
+    const uint8_t second_block[] = {
+        0x82, 0x86, 0x84, 0xbe, 0x58, 0x86, 0xa8, 0xeb, 0x10, 0x64, 0x9c, 0xbf
+    };
+    struct hpack_table decoder, encoder;
+    HpackInit(&decoder, HPACK_TABLE_SIZE);
+    HpackInit(&encoder, HPACK_TABLE_SIZE);
+    vector<struct hpack_field> fields;
+    if (HpackDecode(&decoder, first_block, sizeof(first_block), fields) != 0 ||
+        HpackDecode(&decoder, second_block, sizeof(second_block), fields) != 0 ||
+        fields.size() != 9 || fields[3].value != "www.example.com" ||
+        fields[7].value != "www.example.com" || fields[8].name != "cache-control" ||
+        fields[8].value != "no-cache" || decoder.size != 110) {
+        cerr << "RFC 7541 C.4 example decoded wrong" << endl;
+        passed = 0;
+    }
+    // what we encode has to decode to the same fields, twice over as the
+    // second block leans on the table
+    fields.clear();
+    struct hpack_field f1 = { ":status", "200" }, f2 = { "content-type", "text/html" },
+                       f3 = { "content-length", "1234" }, f4 = { "x-odd", "\x01\xff" };
+    fields.push_back(f1);
+    fields.push_back(f2);
+    fields.push_back(f3);
+    fields.push_back(f4);
+    for (int round = 0; round < 2; round++) {
+        string block;
+        vector<struct hpack_field> decoded;
+        HpackEncode(&encoder, fields, block);
+        if (HpackDecode(&decoder, (const uint8_t *)block.data(), block.size(), decoded) != 0 ||
+            decoded.size() != fields.size() || decoded[3].value != fields[3].value ||
+            decoded[1].value != fields[1].value) {
+            cerr << "encoded header block did not round trip" << endl;
+            passed = 0;
+        }
+    }
+    if (passed) {
+        cerr << "PASSED" << endl;
+        passed = 1;
+    } 
+    else {
+        cerr << "FAILED" << endl;
+    }
+
+    cerr << "testing Http2Framing..." << endl;
+    char h2_dir[] = "/tmp/httpd_h2_XXXXXX";
+    char h2_root[PATH_MAX];
+    if (mkdtemp(h2_dir) == NULL || realpath(h2_dir, h2_root) == NULL) {
+        cerr << "mkdtemp() failed" << endl;
+        passed = 0;
+    }
+    else {
+        string dir = h2_root;
+        string small = "abcdefghijklmnopqrstuvwxyz";
+        string large(100000, 'x');
+        ofstream((dir + "/small.txt").c_str()) << small;
+        ofstream((dir + "/large.txt").c_str()) << large;
+        chmod((dir + "/small.txt").c_str(), 0644);
+        chmod((dir + "/large.txt").c_str(), 0644);
+        uint8_t type, flags;
+        uint32_t stream;
+        string payload;
+
+        // SETTINGS both ways, each ACKed; a 10 byte stream window holds the
+        // body back until a WINDOW_UPDATE lets the rest through
+        int fd;
+        pid_t pid = StartHttp2(dir, &fd);
+        if (pid < 0) {
+            cerr << "could not start an HTTP/2 connection" << endl;
+            passed = 0;
+        }
+        else {
+            string out = H2_PREFACE;
+            out += H2Frame(H2_SETTINGS, 0, 0, H2Setting(H2_SETTINGS_INITIAL_WINDOW_SIZE, 10));
+            send(fd, out.data(), out.size(), 0);
+            if (H2ReadFrame(fd, &type, &flags, &stream, payload) != 0 || type != H2_SETTINGS ||
+                flags != 0 || payload != H2Setting(H2_SETTINGS_MAX_CONCURRENT_STREAMS, H2_MAX_STREAMS)) {
+                cerr << "expected the server's SETTINGS first" << endl;
+                passed = 0;
+            }
+            if (H2ReadFrame(fd, &type, &flags, &stream, payload) != 0 || type != H2_SETTINGS ||
+                flags != H2_ACK || !payload.empty()) {
+                cerr << "expected our SETTINGS to be ACKed" << endl;
+                passed = 0;
+            }
+            out = H2Frame(H2_SETTINGS, H2_ACK, 0, "") + H2Request("/small.txt");
+            send(fd, out.data(), out.size(), 0);
+            struct hpack_table h2_decoder;
+            HpackInit(&h2_decoder, HPACK_TABLE_SIZE);
+            vector<struct hpack_field> h2_fields;
+            if (H2ReadFrame(fd, &type, &flags, &stream, payload) != 0 || type != H2_HEADERS ||
+                stream != 1 || !(flags & H2_END_HEADERS) ||
+                HpackDecode(&h2_decoder, (const uint8_t *)payload.data(), payload.size(), h2_fields) != 0 ||
+                h2_fields.empty() || h2_fields[0].name != ":status" || h2_fields[0].value != "200") {
+                cerr << "expected a 200 HEADERS frame on stream 1" << endl;
+                passed = 0;
+            }
+            if (H2ReadFrame(fd, &type, &flags, &stream, payload) != 0 || type != H2_DATA ||
+                stream != 1 || flags != 0 || payload != small.substr(0, 10)) {
+                cerr << "expected 10 bytes of DATA, as much as the window allows" << endl;
+                passed = 0;
+            }
+            out = H2Frame(H2_WINDOW_UPDATE, 0, 1, H2Uint32(100));
+            send(fd, out.data(), out.size(), 0);
+            if (H2ReadFrame(fd, &type, &flags, &stream, payload) != 0 || type != H2_DATA ||
+                stream != 1 || flags != H2_END_STREAM || payload != small.substr(10)) {
+                cerr << "expected the rest of the body after WINDOW_UPDATE" << endl;
+                passed = 0;
+            }
+            close(fd);
+            waitpid(pid, NULL, 0);
+        }
+
+        // a new INITIAL_WINDOW_SIZE that would take an open stream's window
+        // past 2^31-1 is a FLOW_CONTROL_ERROR
+        pid = StartHttp2(dir, &fd);
+        if (pid < 0) {
+            cerr << "could not start an HTTP/2 connection" << endl;
+            passed = 0;
+        }
+        else {
+            string out = H2_PREFACE;
+            out += H2Frame(H2_SETTINGS, 0, 0, H2Setting(H2_SETTINGS_INITIAL_WINDOW_SIZE, 10));
+            out += H2Request("/large.txt");
+            out += H2Frame(H2_WINDOW_UPDATE, 0, 1, H2Uint32(H2_MAX_WINDOW - 10));
+            send(fd, out.data(), out.size(), 0);
+            // the connection window runs out long before the stream's does
+            size_t received = 0;
+            while (received < H2_DEFAULT_WINDOW &&
+                   H2ReadFrame(fd, &type, &flags, &stream, payload) == 0) {
+                if (type == H2_DATA) {
+                    received += payload.size();
+                }
+            }
+            out = H2Frame(H2_SETTINGS, 0, 0, H2Setting(H2_SETTINGS_INITIAL_WINDOW_SIZE, H2_MAX_WINDOW));
+            send(fd, out.data(), out.size(), 0);
+            int error = -1;
+            while (H2ReadFrame(fd, &type, &flags, &stream, payload) == 0) {
+                if (type == H2_GOAWAY && payload.size() == 8) {
+                    error = (uint8_t)payload[7];
+                    break;
+                }
+            }
+            if (received != H2_DEFAULT_WINDOW || error != H2_FLOW_CONTROL_ERROR) {
+                cerr << "expected GOAWAY with FLOW_CONTROL_ERROR after " << received
+                     << " bytes, got " << error << endl;
+                passed = 0;
+            }
+            close(fd);
+            waitpid(pid, NULL, 0);
+        }
+
+        // PRIORITY has to be 5 bytes (a stream error otherwise) and must
+        // not be on stream 0 (a connection error)
+        pid = StartHttp2(dir, &fd);
+        if (pid < 0) {
+            cerr << "could not start an HTTP/2 connection" << endl;
+            passed = 0;
+        }
+        else {
+            string out = H2_PREFACE;
+            out += H2Frame(H2_SETTINGS, 0, 0, "");
+            out += H2Frame(H2_PRIORITY, 0, 5, H2Uint32(0) + string(1, '\x10'));
+            out += H2Frame(H2_PRIORITY, 0, 3, H2Uint32(0));
+            out += H2Frame(H2_PING, 0, 0, "pingpong");
+            send(fd, out.data(), out.size(), 0);
+            // the server's SETTINGS, the ACK of ours, then the reset and the
+            // PING ACK, with nothing said about the well formed PRIORITY
+            string seen;
+            uint32_t reset = 0, reset_error = 0;
+            while (H2ReadFrame(fd, &type, &flags, &stream, payload) == 0) {
+                seen += to_string(type) + " ";
+                if (type == H2_RST_STREAM && payload.size() == 4) {
+                    reset = stream;
+                    reset_error = (uint8_t)payload[3];
+                }
+                if (type == H2_PING) {
+                    break;
+                }
+            }
+            if (seen != "4 4 3 6 " || reset != 3 || reset_error != H2_FRAME_SIZE_ERROR) {
+                cerr << "expected RST_STREAM 3 with FRAME_SIZE_ERROR, got frames " << seen << endl;
+                passed = 0;
+            }
+            out = H2Frame(H2_PRIORITY, 0, 0, H2Uint32(0) + string(1, '\x10'));
+            send(fd, out.data(), out.size(), 0);
+            int error = -1;
+            if (H2ReadFrame(fd, &type, &flags, &stream, payload) == 0 && type == H2_GOAWAY &&
+                payload.size() == 8) {
+                error = (uint8_t)payload[7];
+            }
+            if (error != H2_PROTOCOL_ERROR) {
+                cerr << "expected GOAWAY with PROTOCOL_ERROR for PRIORITY on stream 0, got "
+                     << error << endl;
+                passed = 0;
+            }
+            close(fd);
+            waitpid(pid, NULL, 0);
+        }
+        unlink((dir + "/small.txt").c_str());
+        unlink((dir + "/large.txt").c_str());
+        rmdir(h2_dir);
+    }
+    if (passed) {
+        cerr << "PASSED" << endl;
+        passed = 1;
+    } 
+    else {
+        cerr << "FAILED" << endl;
+    }
+
+    cerr << "testing TLS..." << endl;
+    char tls_dir[] = "/tmp/httpd_tls_XXXXXX";
+    if (mkdtemp(tls_dir) == NULL) {
+        cerr << "mkdtemp() failed" << endl;
+        passed = 0;
+    }
+    else {
+        string dir = tls_dir;
+        string body(3 * TLS_CHUNK + 123, 'x');
+        for (size_t i = 0; i < body.size(); i++) {
+            body[i] = 'a' + i % 26;
+        }
+        ofstream((dir + "/body").c_str()) << body;
+        int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t addr_len = sizeof(addr);
+        SSL_CTX * client_ctx = SSL_CTX_new(TLS_client_method());
+        SSL_SESSION * session = NULL;
+        if (MakeTestCert(dir + "/cert.pem", dir + "/key.pem") != 0 ||
+            InitTLS((dir + "/cert.pem").c_str(), (dir + "/key.pem").c_str()) != 0 ||
+            bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(listen_fd, 1) != 0 ||
+            getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+            cerr << "could not set up a TLS listener" << endl;
+            passed = 0;
+        }
+        // the second connection has to resume the first one's session
+        for (int round = 0; passed && round < 2; round++) {
+            pid_t pid = fork();
+            if (pid < 0) {
+                cerr << "fork() failed" << endl;
+                passed = 0;
+                break;
+            }
+            if (pid == 0) {
+                TLSTestServer(listen_fd, dir + "/body");
+            }
+            int fd = socket(AF_INET, SOCK_STREAM, 0);
+            SSL * ssl = SSL_new(client_ctx);
+            string reply;
+            if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+                SSL_set_fd(ssl, fd);
+                if (session != NULL) {
+                    SSL_set_session(ssl, session);
+                }
+                char buffer[4096];
+                int n;
+                if (SSL_connect(ssl) == 1 && SSL_write(ssl, "GET / HTTP/1.1\r\n\r\n", 18) == 18) {
+                    while ((n = SSL_read(ssl, buffer, sizeof(buffer))) > 0) {
+                        reply.append(buffer, n);
+                    }
+                }
+            }
+            int status = -1;
+            waitpid(pid, &status, 0);
+            if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                cerr << "TLS server step " << WEXITSTATUS(status) << " failed" << endl;
+                passed = 0;
+            }
+            if (reply != "HTTP/1.1 200 OK\r\n\r\n" + body) {
+                cerr << "expected the whole body over TLS, got " << reply.size() << " bytes" << endl;
+                passed = 0;
+            }
+            if (round == 0) {
+                session = SSL_get1_session(ssl);
+            }
+            else if (!SSL_session_reused(ssl)) {
+                cerr << "expected the session ticket to be accepted" << endl;
+                passed = 0;
+            }
+            // freeing an unshut connection marks its session not resumable
+            SSL_shutdown(ssl);
+            SSL_free(ssl);
+            close(fd);
+        }
+        SSL_SESSION_free(session);
+        SSL_CTX_free(client_ctx);
+        // start_httpd sets up its own context, if it wants one
+        FreeTLS();
+        close(listen_fd);
+        unlink((dir + "/body").c_str());
+        unlink((dir + "/cert.pem").c_str());
+        unlink((dir + "/key.pem").c_str());
+        rmdir(tls_dir);
+    }
+    if (passed) {
+        cerr << "PASSED" << endl;
+        passed = 1;
+    } 
+    else {
+        cerr << "FAILED" << endl;
+    }
+
+    cerr << "testing DirListing..." << endl;
+    char list_dir[] = "/tmp/httpd_list_XXXXXX";
+    char list_root[PATH_MAX];
+    // CheckFile compares against the resolved path; /tmp may be a symlink
+    if (mkdtemp(list_dir) == NULL || realpath(list_dir, list_root) == NULL) {
+        cerr << "mkdtemp() failed" << endl;
+        passed = 0;
+    }
+    else {
+        string dir = list_root;
+        char clnt[] = "127.0.0.1";
+        char fname[PATH_MAX];
+        mkdir((dir + "/site").c_str(), 0755);
+        mkdir((dir + "/big").c_str(), 0755);
+        ofstream((dir + "/site/index.html").c_str()) << "<html>index</html>";
+        ofstream((dir + "/site/a&b.txt").c_str()) << "ab";
+        chmod((dir + "/site/index.html").c_str(), 0644);
+        chmod((dir + "/site/a&b.txt").c_str(), 0644);
+        // none of these would be served, so none may be listed
+        ofstream((dir + "/site/secret.txt").c_str()) << "secret";
+        chmod((dir + "/site/secret.txt").c_str(), 0600);
+        ofstream((dir + ".outside").c_str()) << "outside";
+        chmod((dir + ".outside").c_str(), 0644);
+        symlink((dir + ".outside").c_str(), (dir + "/site/out.txt").c_str());
+        symlink("a&b.txt", (dir + "/site/alias.txt").c_str());
+        // a directory goes by its own .htaccess, for its index too
+        mkdir((dir + "/site/private").c_str(), 0755);
+        ofstream((dir + "/site/private/index.html").c_str()) << "private";
+        chmod((dir + "/site/private/index.html").c_str(), 0644);
+        ofstream((dir + "/site/private/.htaccess").c_str()) << "deny from 10.0.0.0/8";
+        char denied[] = "10.1.2.3";
+        // one more than a batch, so the listing takes two
+        int num_files = DIRLIST_BATCH + 1;
+        for (int i = 0; i < num_files; i++) {
+            ofstream((dir + "/big/f" + to_string(i)).c_str());
+            chmod((dir + "/big/f" + to_string(i)).c_str(), 0644);
+        }
+        if (CheckFile(dir, "/site", fname, clnt) != RESP_MOVED || string(fname) != "/site/") {
+            cerr << "expected a redirect to /site/" << endl;
+            passed = 0;
+        }
+        res = BuildHttpResponse(RESP_MOVED, "/site/");
+        hdr = string(hdr_buf, SerializeResponse(&res, hdr_buf));
+        if (hdr.compare(0, 32, "HTTP/1.1 301 Moved Permanently\r\n") ||
+            hdr.find("\r\nLocation: /site/\r\n") == string::npos) {
+            cerr << "unexpected 301 header: " << hdr << endl;
+            passed = 0;
+        }
+        if (CheckFile(dir, "/site/", fname, clnt) != RESP_OK ||
+            string(fname) != dir + "/site/index.html") {
+            cerr << "expected /site/ to be its index.html" << endl;
+            passed = 0;
+        }
+        if (CheckFile(dir, "/site/private/", fname, clnt) != RESP_OK ||
+            CheckFile(dir, "/site/private/", fname, denied) != RESP_FORBIDDEN ||
+            CheckFile(dir, "/site/private", fname, denied) != RESP_FORBIDDEN ||
+            CheckFile(dir, "/site/", fname, denied) != RESP_OK) {
+            cerr << "expected /site/private/ to follow its own .htaccess" << endl;
+            passed = 0;
+        }
+        // a sibling of the docroot sharing its name as a prefix is outside
+        if (CheckFile(dir, "/site/out.txt", fname, clnt) != RESP_FORBIDDEN) {
+            cerr << "expected /site/out.txt to be forbidden" << endl;
+            passed = 0;
+        }
+        // listings are off until start_httpd() turns them on
+        if (CheckFile(dir, "/big/", fname, clnt) != RESP_NOTFOUND) {
+            cerr << "expected /big/ to be a 404 without -l" << endl;
+            passed = 0;
+        }
+
+        struct dir_listing l;
+        string body;
+        if (OpenListing(dir, dir + "/site/", "/site/", DIRLIST_HTML, &l) != 0 || !l.done) {
+            cerr << "expected a small listing in one batch" << endl;
+            passed = 0;
+        }
+        else {
+            body.resize(l.length);
+            pread(l.fd, &body[0], l.length, 0);
+            if (body.find("<li><a href=\"a%26b.txt\">a&amp;b.txt</a> 2</li>") == string::npos ||
+                body.find("<li><a href=\"alias.txt\">alias.txt</a> 2</li>") == string::npos ||
+                body.find("<li><a href=\"private/\">private/</a></li>") == string::npos ||
+                body.find("secret.txt") != string::npos || body.find("out.txt") != string::npos ||
+                body.find("Index of /site/") == string::npos) {
+                cerr << "unexpected listing: " << body << endl;
+                passed = 0;
+            }
+        }
+        CloseListing(&l);
+        for (int round = 0; round < 3; round++) {
+            // rendered in batches, then cached, then rendered again once
+            // inotify says the directory changed
+            if (round == 2) {
+                ofstream((dir + "/big/new.txt").c_str());
+            }
+            if (OpenListing(dir, dir + "/big/", "/big/", DIRLIST_JSON, &l) != 0 || l.done != (round == 1)) {
+                cerr << "round " << round << ": expected the listing " << (round == 1 ? "cached" : "rendered") << endl;
+                passed = 0;
+            }
+            while (!l.done && NextListing(&l) == 0);
+            body.resize(l.length);
+            pread(l.fd, &body[0], l.length, 0);
+            size_t names = 0;
+            for (size_t pos = 0; (pos = body.find("{\"name\":", pos)) != string::npos; pos++) {
+                names++;
+            }
+            if (body.compare(0, 2, "[\n") || body.compare(body.size() - 3, 3, "\n]\n") ||
+                names != (size_t)num_files + (round == 2)) {
+                cerr << "round " << round << ": unexpected listing of " << names << " entries" << endl;
+                passed = 0;
+            }
+            CloseListing(&l);
+        }
+
+        for (int i = 0; i < num_files; i++) {
+            unlink((dir + "/big/f" + to_string(i)).c_str());
+        }
+        unlink((dir + "/big/new.txt").c_str());
+        unlink((dir + "/site/index.html").c_str());
+        unlink((dir + "/site/a&b.txt").c_str());
+        unlink((dir + "/site/secret.txt").c_str());
+        unlink((dir + "/site/out.txt").c_str());
+        unlink((dir + "/site/alias.txt").c_str());
+        unlink((dir + ".outside").c_str());
+        unlink((dir + "/site/private/index.html").c_str());
+        unlink((dir + "/site/private/.htaccess").c_str());
+        rmdir((dir + "/site/private").c_str());
+        rmdir((dir + "/big").c_str());
+        rmdir((dir + "/site").c_str());
+        rmdir(list_dir);
+    }
+    if (passed) {
+        cerr << "PASSED" << endl;
+        passed = 1;
+    } 
+    else {
+        cerr << "FAILED" << endl;
+    }
+
+    cerr << "testing FlightRecorder..." << endl;
+    char slow_log[] = "/tmp/httpd_slow_XXXXXX";
+    int slow_fd = mkstemp(slow_log);
+    if (slow_fd < 0 || OpenFlightRecorder(slow_log, 20) != 0) {
+        cerr << "could not open " << slow_log << endl;
+        passed = 0;
+    }
+    else {
+        // a fast request, then a slow one that should be logged with it
+        const char * uris[] = { "/fast.html", "/slow.html" };
+        for (int i = 0; i < 2; i++) {
+            FlightBegin(7);
+            FlightStage(FLIGHT_PARSE);
+            FlightRequest("GET", uris[i]);
+            FlightStage(FLIGHT_RESOLVE);
+            FlightSyscall(FLIGHT_SYS_STAT);
+            FlightStage(FLIGHT_HEADER);
+            FlightSyscall(FLIGHT_SYS_SEND);
+            if (i == 1) {
+                usleep(30000);
+            }
+            FlightEnd(RESP_OK, 100 + i);
+        }
+        // outside a request nothing is recorded
+        FlightSyscall(FLIGHT_SYS_SEND);
+        CloseFlightRecorder();
+        string log;
+        char buf[BUFSIZE];
+        ssize_t n;
+        while ((n = read(slow_fd, buf, sizeof(buf))) > 0) {
+            log.append(buf, n);
+        }
+        if (log.find("fd 7 GET /slow.html 200 101 bytes") == string::npos ||
+            log.find("  syscalls: recv 0 send 1 sendfile 0 open 0 stat 1\n") == string::npos ||
+            log.find("  before it:\n  ") == string::npos ||
+            log.find("fd 7 GET /fast.html 200 100 bytes") == string::npos ||
+            log.find("slow request", 1) != string::npos) {
+            cerr << "unexpected slow log: " << log << endl;
+            passed = 0;
+        }
+    }
+    if (slow_fd >= 0) {
+        close(slow_fd);
+        unlink(slow_log);
+    }
+    if (passed) {
+        cerr << "PASSED" << endl;
+        passed = 1;
+    } 
+    else {
+        cerr << "FAILED" << endl;
+    }
+
+    cerr << "testing SocketProfile..." << endl;
+    struct sock_profile prof;
+    DefaultSockProfile(&prof);
+    if (!prof.nodelay) {
+        cerr << "expected TCP_NODELAY in the default profile" << endl;
+        passed = 0;
+    }
+    if (ParseSockProfile("latency,sndbuf=65536,busy_poll=0,ipv6", &prof) != 0 ||
+        !prof.reuseaddr || !prof.nodelay || prof.defer_accept != 1 || prof.busy_poll != 0 ||
+        prof.notsent_lowat != 16384 || prof.sndbuf != 65536 || !prof.ipv6 ||
+        prof.backlog != SOCK_BACKLOG) {
+        cerr << "unexpected profile from \"latency,sndbuf=65536,busy_poll=0,ipv6\"" << endl;
+        passed = 0;
+    }
+    if (ParseSockProfile("nodelay=1", &prof) == 0 || ParseSockProfile("sndbuf", &prof) == 0 ||
+        ParseSockProfile("fastopen=-1", &prof) == 0 || ParseSockProfile("bogus", &prof) == 0) {
+        cerr << "expected bad socket options to be rejected" << endl;
+        passed = 0;
+    }
+    // a dual-stack listener takes IPv4 connections, which inherit its options
+    int sock_fd = OpenListenSocket(0, &prof);
+    struct sockaddr_in6 bound;
+    socklen_t bound_len = sizeof(bound);
+    if (sock_fd < 0 || getsockname(sock_fd, (struct sockaddr *)&bound, &bound_len) != 0 ||
+        bound.sin6_family != AF_INET6) {
+        cerr << "could not open an IPv6 listener" << endl;
+        passed = 0;
+    }
+    else {
+        struct sockaddr_in to;
+        memset(&to, 0, sizeof(to));
+        to.sin_family = AF_INET;
+        to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        to.sin_port = bound.sin6_port;
+        int clnt_fd = socket(AF_INET, SOCK_STREAM, 0);
+        // with defer_accept the connection is only queued once data is in
+        int conn_fd = -1;
+        if (connect(clnt_fd, (struct sockaddr *)&to, sizeof(to)) == 0 &&
+            send(clnt_fd, "x", 1, 0) == 1) {
+            conn_fd = accept(sock_fd, NULL, NULL);
+        }
+        int nodelay = 0, lowat = 0;
+        socklen_t opt_len = sizeof(int);
+        getsockopt(conn_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &opt_len);
+        opt_len = sizeof(int);
+        getsockopt(conn_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, &opt_len);
+        if (conn_fd < 0 || !nodelay || lowat != 16384) {
+            cerr << "expected an accepted IPv4 connection with the listener's options" << endl;
+            passed = 0;
+        }
+        if (conn_fd >= 0) {
+            close(conn_fd);
+        }
+        close(clnt_fd);
+        // retuned as after an upgrade, it loses what the new profile leaves out
+        struct sock_profile plain;
+        DefaultSockProfile(&plain);
+        ParseSockProfile("nonodelay", &plain);
+        TuneListener(sock_fd, &plain);
+        int defer = -1;
+        nodelay = lowat = -1;
+        opt_len = sizeof(int);
+        getsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &opt_len);
+        opt_len = sizeof(int);
+        getsockopt(sock_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, &opt_len);
+        opt_len = sizeof(int);
+        getsockopt(sock_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, &opt_len);
+        if (nodelay != 0 || defer != 0 || lowat != 0) {
+            cerr << "expected a retuned listener to drop the latency options" << endl;
+            passed = 0;
+        }
+        close(sock_fd);
+    }
+    if (passed) {
+        cerr << "PASSED" << endl;
+        passed = 1;
+    } 
+    else {
+        cerr << "FAILED" << endl;
+    }
+
     cerr << "********** ALL TESTS FINISHED **********" << endl << endl;
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 3) {
+    struct httpd_conf conf;
+    memset(&conf, 0, sizeof(conf));
+    int opt;
+
+    conf.capture_sample = 1;
+    conf.slow_ms = -1;
+    DefaultSockProfile(&conf.sock);
+    while ((opt = getopt(argc, argv, "w:c:s:t:C:K:lS:F:o:")) != -1) {
+        switch (opt) {
+            case 'w':
+                if (strcmp(optarg, "numa") == 0) {
+                    conf.numa = 1;
+                }
+                else if ((conf.workers = atoi(optarg)) <= 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'c':
+                conf.capture = optarg;
+                break;
+            case 's':
+                if ((conf.capture_sample = atoi(optarg)) <= 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 't': {
+                long int tls_port = strtol(optarg, NULL, 10);
+                if (tls_port <= 0 || tls_port > USHRT_MAX) {
+                    cerr << "Invalid port: " << optarg << endl;
+                    return 3;
+                }
+                conf.tls_port = tls_port;
+                break;
+            }
+            case 'C':
+                conf.tls_cert = optarg;
+                break;
+            case 'K':
+                conf.tls_key = optarg;
+                break;
+            case 'l':
+                conf.listings = 1;
+                break;
+            case 'S':
+                if ((conf.slow_ms = atoi(optarg)) < 0 || !isdigit(optarg[0])) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'F':
+                conf.slow_log = optarg;
+                break;
+            case 'o':
+                if (ParseSockProfile(optarg, &conf.sock) != 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if ((conf.tls_port != 0) != (conf.tls_cert != NULL) ||
+        (conf.slow_log != NULL && conf.slow_ms < 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (argc - optind != 2) {
             usage(argv[0]);
             return 1;
     }
 
-    long int port = strtol(argv[1], NULL, 10);
+    long int port = strtol(argv[optind], NULL, 10);
 
     if (errno == EINVAL || errno == ERANGE) {
             usage(argv[0]);
@@ -156,12 +1294,18 @@ int main(int argc, char *argv[])
             return 3;
     }
 
-    string doc_root = argv[2];
-    
-    runtests();
+    string doc_root = argv[optind + 1];
 
-    start_httpd(port, doc_root);
+    // extend the built-in content types before anything looks one up
+    LoadMimeTypes(MIME_TYPES_FILE);
+    
+    // an upgrade exec takes over live listeners and has to report ready
+    // promptly; the binary it replaces ran the tests already
+    if (getenv(UPGRADE_ENV) == NULL) {
+        runtests();
+    }
 
-    return 0;
+    SetUpgradeArgs(argc, argv);
+    return start_httpd(port, doc_root, &conf) == 0 ? 0 : 1;
 }
 
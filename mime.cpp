@@ -0,0 +1,569 @@
+#include "httpd.h"
+#include "mime.h"
+#include "phash.h"
+#include <set>
+#include <sstream>
+
+/*
+ *  Maps file extensions to Content-type values. A few hundred common types
+ *  are compiled in; LoadMimeTypes() can add more from a mime.types file
+ *  before the server starts. The first lookup freezes everything into a
+ *  perfect hash keyed on the lowercased last extension, so a lookup is a
+ *  single slot probe and one string compare.
+ */
+
+using namespace std;
+
+typedef struct mime_entry {
+    const char * ext;
+    const char * type;
+} mime_entry;
+
+static constexpr struct mime_entry builtin_types[] = {
+    // text
+    { "appcache", "text/cache-manifest" },
+    { "bib", "text/x-bibtex" },
+    { "boo", "text/x-boo" },
+    { "brf", "text/plain" },
+    { "c", "text/x-csrc" },
+    { "c++", "text/x-c++src" },
+    { "cc", "text/x-c++src" },
+    { "cls", "text/x-tex" },
+    { "cnd", "text/jcr-cnd" },
+    { "cpp", "text/x-c++src" },
+    { "cql", "text/cql" },
+    { "csh", "text/x-csh" },
+    { "css", "text/css" },
+    { "csv", "text/csv" },
+    { "csvs", "text/csv-schema" },
+    { "cxx", "text/x-c++src" },
+    { "d", "text/x-dsrc" },
+    { "diff", "text/x-diff" },
+    { "es", "text/javascript" },
+    { "etx", "text/x-setext" },
+    { "gcd", "text/x-pcs-gcd" },
+    { "gff3", "text/gff3" },
+    { "h", "text/x-chdr" },
+    { "h++", "text/x-c++hdr" },
+    { "hh", "text/x-c++hdr" },
+    { "hpp", "text/x-c++hdr" },
+    { "hs", "text/x-haskell" },
+    { "htc", "text/x-component" },
+    { "htm", "text/html" },
+    { "html", "text/html" },
+    { "hxx", "text/x-c++hdr" },
+    { "ics", "text/calendar" },
+    { "ifb", "text/calendar" },
+    { "jad", "text/vnd.sun.j2me.app-descriptor" },
+    { "java", "text/x-java" },
+    { "js", "text/javascript" },
+    { "lhs", "text/x-literate-haskell" },
+    { "ltx", "text/x-tex" },
+    { "ly", "text/x-lilypond" },
+    { "manifest", "text/cache-manifest" },
+    { "markdown", "text/markdown" },
+    { "md", "text/markdown" },
+    { "miz", "text/mizar" },
+    { "mjs", "text/javascript" },
+    { "moc", "text/x-moc" },
+    { "n3", "text/n3" },
+    { "p", "text/x-pascal" },
+    { "pas", "text/x-pascal" },
+    { "patch", "text/x-diff" },
+    { "pl", "text/x-perl" },
+    { "pm", "text/x-perl" },
+    { "pot", "text/plain" },
+    { "provn", "text/provenance-notation" },
+    { "py", "text/x-python" },
+    { "roff", "text/troff" },
+    { "scala", "text/x-scala" },
+    { "sfv", "text/x-sfv" },
+    { "sgm", "text/SGML" },
+    { "sgml", "text/SGML" },
+    { "shaclc", "text/shaclc" },
+    { "shc", "text/shaclc" },
+    { "shex", "text/shex" },
+    { "shtml", "text/html" },
+    { "soa", "text/dns" },
+    { "spdx", "text/spdx" },
+    { "srt", "text/plain" },
+    { "sty", "text/x-tex" },
+    { "t", "text/troff" },
+    { "tex", "text/x-tex" },
+    { "text", "text/plain" },
+    { "tk", "text/x-tcl" },
+    { "tm", "text/texmacs" },
+    { "tr", "text/troff" },
+    { "tsv", "text/tab-separated-values" },
+    { "ttl", "text/turtle" },
+    { "txt", "text/plain" },
+    { "uri", "text/uri-list" },
+    { "uris", "text/uri-list" },
+    { "vcard", "text/vcard" },
+    { "vcf", "text/vcard" },
+    { "vcs", "text/x-vcalendar" },
+    { "vtt", "text/vtt" },
+    { "wgsl", "text/wgsl" },
+    { "wml", "text/vnd.wap.wml" },
+    { "zone", "text/dns" },
+
+    // image
+    { "apng", "image/apng" },
+    { "art", "image/x-jg" },
+    { "avci", "image/avci" },
+    { "avcs", "image/avcs" },
+    { "avif", "image/avif" },
+    { "bmp", "image/bmp" },
+    { "cdr", "image/x-coreldraw" },
+    { "cdt", "image/x-coreldrawtemplate" },
+    { "cgm", "image/cgm" },
+    { "cpt", "image/x-corelphotopaint" },
+    { "cr2", "image/x-canon-cr2" },
+    { "crw", "image/x-canon-crw" },
+    { "djv", "image/vnd.djvu" },
+    { "djvu", "image/vnd.djvu" },
+    { "dpx", "image/dpx" },
+    { "drle", "image/dicom-rle" },
+    { "dwg", "image/vnd.dwg" },
+    { "dxf", "image/vnd.dxf" },
+    { "emf", "image/emf" },
+    { "erf", "image/x-epson-erf" },
+    { "exr", "image/aces" },
+    { "fit", "image/fits" },
+    { "fits", "image/fits" },
+    { "fts", "image/fits" },
+    { "gif", "image/gif" },
+    { "heic", "image/heic" },
+    { "heics", "image/heic-sequence" },
+    { "heif", "image/heif" },
+    { "heifs", "image/heif-sequence" },
+    { "hej2", "image/hej2k" },
+    { "hif", "image/avif" },
+    { "hsj2", "image/hsj2" },
+    { "ico", "image/vnd.microsoft.icon" },
+    { "ief", "image/ief" },
+    { "jfif", "image/jpeg" },
+    { "jhc", "image/jphc" },
+    { "jls", "image/jls" },
+    { "jng", "image/x-jng" },
+    { "jp2", "image/jp2" },
+    { "jpe", "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "jpf", "image/jpx" },
+    { "jpg", "image/jpeg" },
+    { "jpg2", "image/jp2" },
+    { "jpgm", "image/jpm" },
+    { "jph", "image/jph" },
+    { "jphc", "image/jphc" },
+    { "jpm", "image/jpm" },
+    { "jpx", "image/jpx" },
+    { "jxl", "image/jxl" },
+    { "jxr", "image/jxr" },
+    { "jxra", "image/jxrA" },
+    { "jxrs", "image/jxrS" },
+    { "jxs", "image/jxs" },
+    { "jxsc", "image/jxsc" },
+    { "jxsi", "image/jxsi" },
+    { "jxss", "image/jxss" },
+    { "ktx", "image/ktx" },
+    { "ktx2", "image/ktx2" },
+    { "nef", "image/x-nikon-nef" },
+    { "orf", "image/x-olympus-orf" },
+    { "pat", "image/x-coreldrawpattern" },
+    { "pbm", "image/x-portable-bitmap" },
+    { "pgm", "image/x-portable-graymap" },
+    { "png", "image/png" },
+    { "pnm", "image/x-portable-anymap" },
+    { "ppm", "image/x-portable-pixmap" },
+    { "psd", "image/vnd.adobe.photoshop" },
+    { "ras", "image/x-cmu-raster" },
+    { "rgb", "image/x-rgb" },
+    { "svg", "image/svg+xml" },
+    { "svgz", "image/svg+xml" },
+    { "tfx", "image/tiff-fx" },
+    { "tif", "image/tiff" },
+    { "tiff", "image/tiff" },
+    { "wbmp", "image/vnd.wap.wbmp" },
+    { "webp", "image/webp" },
+    { "wmf", "image/wmf" },
+    { "xbm", "image/x-xbitmap" },
+    { "xcf", "image/x-xcf" },
+    { "xpm", "image/x-xpixmap" },
+    { "xwd", "image/x-xwindowdump" },
+
+    // audio
+    { "726", "audio/32kadpcm" },
+    { "aa3", "audio/ATRAC3" },
+    { "aac", "audio/aac" },
+    { "aal", "audio/ATRAC-ADVANCED-LOSSLESS" },
+    { "ac3", "audio/ac3" },
+    { "acn", "audio/asc" },
+    { "adts", "audio/aac" },
+    { "aif", "audio/x-aiff" },
+    { "aifc", "audio/x-aiff" },
+    { "aiff", "audio/x-aiff" },
+    { "amr", "audio/AMR" },
+    { "ass", "audio/aac" },
+    { "at3", "audio/ATRAC3" },
+    { "atx", "audio/ATRAC-X" },
+    { "au", "audio/basic" },
+    { "awb", "audio/AMR-WB" },
+    { "axa", "audio/annodex" },
+    { "csd", "audio/csound" },
+    { "dls", "audio/dls" },
+    { "enw", "audio/EVRCNW" },
+    { "evb", "audio/EVRCB" },
+    { "evc", "audio/EVRC" },
+    { "evw", "audio/EVRCWB" },
+    { "flac", "audio/flac" },
+    { "gsm", "audio/x-gsm" },
+    { "l16", "audio/L16" },
+    { "lbc", "audio/iLBC" },
+    { "loas", "audio/usac" },
+    { "m3u", "audio/mpegurl" },
+    { "m4a", "audio/mp4" },
+    { "mhas", "audio/mhas" },
+    { "mid", "audio/sp-midi" },
+    { "mp1", "audio/mpeg" },
+    { "mp2", "audio/mpeg" },
+    { "mp3", "audio/mpeg" },
+    { "mpega", "audio/mpeg" },
+    { "mpga", "audio/mpeg" },
+    { "mxmf", "audio/mobile-xmf" },
+    { "oga", "audio/ogg" },
+    { "ogg", "audio/ogg" },
+    { "omg", "audio/ATRAC3" },
+    { "opus", "audio/ogg" },
+    { "orc", "audio/csound" },
+    { "pls", "audio/x-scpls" },
+    { "qcp", "audio/EVRC-QCP" },
+    { "ra", "audio/x-pn-realaudio" },
+    { "ram", "audio/x-pn-realaudio" },
+    { "rm", "audio/x-pn-realaudio" },
+    { "sco", "audio/csound" },
+    { "sd2", "audio/x-sd2" },
+    { "smv", "audio/SMV" },
+    { "snd", "audio/basic" },
+    { "sofa", "audio/sofa" },
+    { "spx", "audio/ogg" },
+    { "wav", "audio/x-wav" },
+    { "wax", "audio/x-ms-wax" },
+    { "wma", "audio/x-ms-wma" },
+    { "xhe", "audio/usac" },
+
+    // video
+    { "avi", "video/x-msvideo" },
+    { "axv", "video/annodex" },
+    { "dif", "video/dv" },
+    { "dv", "video/dv" },
+    { "fli", "video/fli" },
+    { "flv", "video/x-flv" },
+    { "gl", "video/gl" },
+    { "lsf", "video/x-la-asf" },
+    { "lsx", "video/x-la-asf" },
+    { "m1v", "video/mpeg" },
+    { "m2v", "video/mpeg" },
+    { "m4s", "video/iso.segment" },
+    { "m4u", "video/vnd.mpegurl" },
+    { "m4v", "video/mp4" },
+    { "mj2", "video/mj2" },
+    { "mjp2", "video/mj2" },
+    { "mkv", "video/x-matroska" },
+    { "mng", "video/x-mng" },
+    { "mov", "video/quicktime" },
+    { "movie", "video/x-sgi-movie" },
+    { "mp4", "video/mp4" },
+    { "mpe", "video/mpeg" },
+    { "mpeg", "video/mpeg" },
+    { "mpg", "video/mpeg" },
+    { "mpg4", "video/mp4" },
+    { "mpv", "video/x-matroska" },
+    { "mxu", "video/vnd.mpegurl" },
+    { "ogv", "video/ogg" },
+    { "qt", "video/quicktime" },
+    { "ts", "video/mp2t" },
+    { "webm", "video/webm" },
+    { "wm", "video/x-ms-wm" },
+    { "wmv", "video/x-ms-wmv" },
+    { "wmx", "video/x-ms-wmx" },
+    { "wvx", "video/x-ms-wvx" },
+
+    // font
+    { "otf", "font/otf" },
+    { "ttc", "font/collection" },
+    { "ttf", "font/ttf" },
+    { "woff", "font/woff" },
+    { "woff2", "font/woff2" },
+
+    // application
+    { "7z", "application/x-7z-compressed" },
+    { "abw", "application/x-abiword" },
+    { "ai", "application/postscript" },
+    { "apk", "application/vnd.android.package-archive" },
+    { "atom", "application/atom+xml" },
+    { "bak", "application/x-trash" },
+    { "bat", "application/x-msdos-program" },
+    { "bcpio", "application/x-bcpio" },
+    { "bin", "application/octet-stream" },
+    { "br", "application/octet-stream" },
+    { "cer", "application/pkix-cert" },
+    { "com", "application/x-msdos-program" },
+    { "cpio", "application/x-cpio" },
+    { "crl", "application/pkix-crl" },
+    { "crt", "application/x-x509-ca-cert" },
+    { "dcm", "application/dicom" },
+    { "dcr", "application/x-director" },
+    { "deploy", "application/octet-stream" },
+    { "dir", "application/x-director" },
+    { "dist", "application/vnd.apple.installer+xml" },
+    { "distz", "application/vnd.apple.installer+xml" },
+    { "dll", "application/x-msdos-program" },
+    { "dmg", "application/x-apple-diskimage" },
+    { "doc", "application/msword" },
+    { "docx", "application/vnd.openxmlformats-officedocument.wordprocessingml.document" },
+    { "dtd", "application/xml-dtd" },
+    { "dvi", "application/x-dvi" },
+    { "dxr", "application/x-director" },
+    { "eot", "application/vnd.ms-fontobject" },
+    { "eps", "application/postscript" },
+    { "eps2", "application/postscript" },
+    { "eps3", "application/postscript" },
+    { "epsf", "application/postscript" },
+    { "epsi", "application/postscript" },
+    { "epub", "application/epub+zip" },
+    { "exe", "application/x-msdos-program" },
+    { "fig", "application/x-xfig" },
+    { "geojson", "application/geo+json" },
+    { "gnumeric", "application/x-gnumeric" },
+    { "grxml", "application/srgs+xml" },
+    { "gtar", "application/x-gtar" },
+    { "gz", "application/gzip" },
+    { "hdf", "application/x-hdf" },
+    { "iso", "application/x-iso9660-image" },
+    { "jar", "application/java-archive" },
+    { "jnlp", "application/x-java-jnlp-file" },
+    { "json", "application/json" },
+    { "jsonld", "application/ld+json" },
+    { "kil", "application/x-killustrator" },
+    { "kml", "application/vnd.google-earth.kml+xml" },
+    { "kmz", "application/vnd.google-earth.kmz" },
+    { "latex", "application/x-latex" },
+    { "lha", "application/x-lha" },
+    { "lzh", "application/x-lzh" },
+    { "m3u8", "application/vnd.apple.mpegurl" },
+    { "map", "application/json" },
+    { "mbox", "application/mbox" },
+    { "mm", "application/x-freemind" },
+    { "mml", "application/mathml+xml" },
+    { "mod", "application/xml-dtd" },
+    { "mpkg", "application/vnd.apple.installer+xml" },
+    { "msi", "application/x-msi" },
+    { "msp", "application/octet-stream" },
+    { "msu", "application/octet-stream" },
+    { "nc", "application/x-netcdf" },
+    { "o", "application/x-object" },
+    { "odg", "application/vnd.oasis.opendocument.graphics" },
+    { "odp", "application/vnd.oasis.opendocument.presentation" },
+    { "ods", "application/vnd.oasis.opendocument.spreadsheet" },
+    { "odt", "application/vnd.oasis.opendocument.text" },
+    { "ogx", "application/ogg" },
+    { "old", "application/x-trash" },
+    { "p10", "application/pkcs10" },
+    { "p12", "application/pkcs12" },
+    { "p7c", "application/pkcs7-mime" },
+    { "p7m", "application/pkcs7-mime" },
+    { "p7s", "application/pkcs7-signature" },
+    { "p7z", "application/pkcs7-mime" },
+    { "pac", "application/x-ns-proxy-autoconfig" },
+    { "pdf", "application/pdf" },
+    { "pfx", "application/pkcs12" },
+    { "pkg", "application/vnd.apple.installer+xml" },
+    { "pps", "application/vnd.ms-powerpoint" },
+    { "ppt", "application/vnd.ms-powerpoint" },
+    { "pptx", "application/vnd.openxmlformats-officedocument.presentationml.presentation" },
+    { "ps", "application/postscript" },
+    { "pyc", "application/x-python-code" },
+    { "pyo", "application/x-python-code" },
+    { "qgs", "application/x-qgis" },
+    { "qtl", "application/x-quicktimeplayer" },
+    { "rar", "application/vnd.rar" },
+    { "rb", "application/x-ruby" },
+    { "rdf", "application/rdf+xml" },
+    { "rpm", "application/x-redhat-package-manager" },
+    { "rq", "application/sparql-query" },
+    { "rtf", "application/rtf" },
+    { "sh", "application/x-sh" },
+    { "shar", "application/x-shar" },
+    { "shp", "application/x-qgis" },
+    { "shx", "application/x-qgis" },
+    { "sig", "application/pgp-signature" },
+    { "sik", "application/x-trash" },
+    { "sit", "application/x-stuffit" },
+    { "sitx", "application/x-stuffit" },
+    { "smi", "application/smil+xml" },
+    { "smil", "application/smil+xml" },
+    { "sml", "application/smil+xml" },
+    { "sql", "application/sql" },
+    { "src", "application/x-wais-source" },
+    { "ssml", "application/ssml+xml" },
+    { "sv4cpio", "application/x-sv4cpio" },
+    { "sv4crc", "application/x-sv4crc" },
+    { "tar", "application/x-tar" },
+    { "taz", "application/x-gtar-compressed" },
+    { "tcl", "application/x-tcl" },
+    { "texi", "application/x-texinfo" },
+    { "texinfo", "application/x-texinfo" },
+    { "tgz", "application/gzip" },
+    { "toml", "application/toml" },
+    { "torrent", "application/x-bittorrent" },
+    { "ustar", "application/x-ustar" },
+    { "vcd", "application/x-cdlink" },
+    { "vsd", "application/vnd.visio" },
+    { "vss", "application/vnd.visio" },
+    { "vst", "application/vnd.visio" },
+    { "vsw", "application/vnd.visio" },
+    { "wad", "application/x-doom" },
+    { "wasm", "application/wasm" },
+    { "webmanifest", "application/manifest+json" },
+    { "wmlc", "application/vnd.wap.wmlc" },
+    { "xht", "application/xhtml+xml" },
+    { "xhtm", "application/xhtml+xml" },
+    { "xhtml", "application/xhtml+xml" },
+    { "xla", "application/vnd.ms-excel" },
+    { "xlc", "application/vnd.ms-excel" },
+    { "xlm", "application/vnd.ms-excel" },
+    { "xls", "application/vnd.ms-excel" },
+    { "xlsx", "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet" },
+    { "xlt", "application/vnd.ms-excel" },
+    { "xlw", "application/vnd.ms-excel" },
+    { "xml", "application/xml" },
+    { "xpi", "application/x-xpinstall" },
+    { "xsl", "application/xslt+xml" },
+    { "xslt", "application/xslt+xml" },
+    { "xspf", "application/xspf+xml" },
+    { "xul", "application/vnd.mozilla.xul+xml" },
+    { "xz", "application/x-xz" },
+    { "yaml", "application/yaml" },
+    { "yml", "application/yaml" },
+    { "zip", "application/zip" },
+    { "zst", "application/zstd" },
+};
+
+typedef struct mime_registry {
+    int frozen;
+    vector<string> exts;
+    vector<string> types;
+    struct phash_table table;
+} mime_registry;
+
+static struct mime_registry registry;
+
+
+/*
+ *  Add an extension unless it is already known; earlier entries win, so
+ *  the compiled-in types are never overridden by the system file.
+ */
+static void AddMimeType(string ext, string type, set<string> & known) {
+
+    transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    if (ext.empty() || ext.size() > MIME_MAX_EXT || type.size() > MIME_MAX_TYPE ||
+        !known.insert(ext).second) {
+        return;
+    }
+    registry.exts.push_back(ext);
+    registry.types.push_back(type);
+}
+
+
+static void LoadBuiltinTypes() {
+
+    if (!registry.exts.empty()) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]); i++) {
+        registry.exts.push_back(builtin_types[i].ext);
+        registry.types.push_back(builtin_types[i].type);
+    }
+}
+
+
+/*
+ *  Extend the registry from a mime.types file ("type ext ext ..." per line,
+ *  '#' comments). Must be called before the first MimeType() lookup.
+ *  Returns the number of extensions added, or -1 if the file can't be read.
+ */
+int LoadMimeTypes(string path) {
+
+    if (registry.frozen) {
+        cerr << "mime types already frozen, ignoring " << path << endl;
+        return -1;
+    }
+    ifstream infile(path.c_str());
+    if (!infile.is_open()) {
+        return -1;
+    }
+    LoadBuiltinTypes();
+    size_t before = registry.exts.size();
+    set<string> known(registry.exts.begin(), registry.exts.end());
+    string line, type, ext;
+    while (getline(infile, line)) {
+        line = line.substr(0, line.find('#'));
+        istringstream words(line);
+        if (!(words >> type)) {
+            continue;
+        }
+        while (words >> ext) {
+            AddMimeType(ext, type, known);
+        }
+    }
+    return registry.exts.size() - before;
+}
+
+
+static void FreezeMimeTypes() {
+
+    LoadBuiltinTypes();
+    if (BuildPerfectHash(registry.exts, &registry.table) != 0) {
+        // can't happen for unique keys short of PHASH_MAX_TRIES; fall back
+        // to the default type for everything rather than refusing to serve
+        cerr << "could not build mime type table" << endl;
+        registry.exts.clear();
+        registry.types.clear();
+        BuildPerfectHash(registry.exts, &registry.table);
+    }
+    registry.frozen = 1;
+}
+
+
+/*
+ *  Content-type for fname, chosen by its last extension (case insensitive).
+ *  Files without a known extension are served as MIME_DEFAULT.
+ */
+const char * MimeType(string fname) {
+
+    if (!registry.frozen) {
+        FreezeMimeTypes();
+    }
+
+    size_t dot = fname.rfind('.');
+    size_t slash = fname.rfind('/');
+    if (dot == string::npos || (slash != string::npos && dot < slash)) {
+        return MIME_DEFAULT;
+    }
+    size_t len = fname.size() - dot - 1;
+    if (len == 0 || len > MIME_MAX_EXT) {
+        return MIME_DEFAULT;
+    }
+    char ext[MIME_MAX_EXT];
+    for (size_t i = 0; i < len; i++) {
+        ext[i] = tolower((unsigned char)fname[dot + 1 + i]);
+    }
+
+    const struct phash_table & t = registry.table;
+    uint32_t slot = PHashSlot(&t.disp[0], t.num_buckets, t.table_size, ext, len);
+    uint32_t idx = t.slots[slot];
+    if (idx == 0 || registry.exts[idx - 1].compare(0, string::npos, ext, len) != 0) {
+        return MIME_DEFAULT;
+    }
+    return registry.types[idx - 1].c_str();
+}
@@ -0,0 +1,16 @@
+#ifndef MIME_H
+#define MIME_H
+
+#include <string>
+
+using namespace std;
+
+#define MIME_DEFAULT    "application/octet-stream"
+#define MIME_TYPES_FILE "/etc/mime.types"
+#define MIME_MAX_EXT    16
+#define MIME_MAX_TYPE   127
+
+int LoadMimeTypes(string path);
+const char * MimeType(string fname);
+
+#endif // MIME_H
@@ -0,0 +1,43 @@
+#include <iostream>
+#include "httpd.h"
+#include "archive.h"
+#include "mime.h"
+
+using namespace std;
+
+/*
+ *  Packs a docroot into a single archive that httpd can serve directly:
+ *
+ *      packsite [-z] docroot_dir archive_file
+ *      httpd listen_port archive_file
+ *
+ *  -z also stores gzip variants of text files for clients that accept them.
+ */
+
+void usage(char * argv0)
+{
+    cerr << "Usage: " << argv0 << " [-z] docroot_dir archive_file" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int gzip = 0;
+    int arg = 1;
+
+    if (argc > 1 && string(argv[1]) == "-z") {
+            gzip = 1;
+            arg++;
+    }
+    if (argc - arg != 2) {
+            usage(argv[0]);
+            return 1;
+    }
+
+    LoadMimeTypes(MIME_TYPES_FILE);
+
+    if (PackSite(argv[arg], argv[arg + 1], gzip) != 0) {
+            return 2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+#include "phash.h"
+#include <algorithm>
+
+using namespace std;
+
+#define PHASH_MAX_TRIES (1 << 20)
+
+
+/*
+ *  Seeded FNV-1a with a final avalanche so the low bits (which are all
+ *  we keep after masking) depend on every input byte.
+ */
+uint32_t PHashString(const char * key, size_t len, uint32_t seed) {
+
+    uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)key[i];
+        h *= 16777619u;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+
+static uint32_t NextPow2(uint32_t n) {
+
+    uint32_t p = 1;
+    while (p < n) {
+        p <<= 1;
+    }
+    return p;
+}
+
+
+/*
+ *  Build a perfect hash over keys (which must be unique).
+ *  Returns 0 on success, -1 if no displacement could be found.
+ */
+int BuildPerfectHash(const vector<string> & keys, struct phash_table * table) {
+
+    uint32_t n = keys.size();
+    table->num_buckets = NextPow2(max(1u, n / 2));
+    table->table_size = NextPow2(max(1u, n * 2));
+    table->disp.assign(table->num_buckets, 0);
+    table->slots.assign(table->table_size, 0);
+
+    // group keys by their first-level bucket
+    vector<vector<uint32_t> > buckets(table->num_buckets);
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t b = PHashString(keys[i].data(), keys[i].size(), 0) &
+                     (table->num_buckets - 1);
+        buckets[b].push_back(i);
+    }
+
+    // place the most crowded buckets first while the table is still empty
+    vector<uint32_t> order(table->num_buckets);
+    for (uint32_t b = 0; b < table->num_buckets; b++) {
+        order[b] = b;
+    }
+    stable_sort(order.begin(), order.end(),
+                [&buckets](uint32_t a, uint32_t b) {
+                    return buckets[a].size() > buckets[b].size();
+                });
+
+    vector<uint32_t> placed;
+    for (uint32_t o = 0; o < table->num_buckets; o++) {
+        vector<uint32_t> & bucket = buckets[order[o]];
+        if (bucket.empty()) {
+            break;
+        }
+        uint32_t d;
+        for (d = 1; d < PHASH_MAX_TRIES; d++) {
+            placed.clear();
+            for (size_t k = 0; k < bucket.size(); k++) {
+                const string & key = keys[bucket[k]];
+                uint32_t s = PHashString(key.data(), key.size(), d) &
+                             (table->table_size - 1);
+                if (table->slots[s] != 0 ||
+                    find(placed.begin(), placed.end(), s) != placed.end()) {
+                    break;
+                }
+                placed.push_back(s);
+            }
+            if (placed.size() == bucket.size()) {
+                break;
+            }
+        }
+        if (d == PHASH_MAX_TRIES) {
+            return -1;
+        }
+        table->disp[order[o]] = d;
+        for (size_t k = 0; k < bucket.size(); k++) {
+            table->slots[placed[k]] = bucket[k] + 1;
+        }
+    }
+    return 0;
+}
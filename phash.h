@@ -0,0 +1,37 @@
+#ifndef PHASH_H
+#define PHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+ *  Minimal perfect hashing (hash-and-displace). Keys are first split into
+ *  buckets with seed 0, then every bucket gets its own displacement seed
+ *  chosen so that all keys land in distinct slots of a power-of-two table.
+ *  A lookup is therefore two hashes and exactly one slot probe.
+ */
+typedef struct phash_table {
+    uint32_t num_buckets;       // power of two
+    uint32_t table_size;        // power of two
+    vector<uint32_t> disp;      // per-bucket displacement seed
+    vector<uint32_t> slots;     // key index + 1, or 0 for an empty slot
+} phash_table;
+
+uint32_t PHashString(const char * key, size_t len, uint32_t seed);
+int BuildPerfectHash(const vector<string> & keys, struct phash_table * table);
+
+/*
+ *  Returns the only slot key can occupy; the caller still has to compare
+ *  the key stored there since absent keys hash somewhere too.
+ */
+inline uint32_t PHashSlot(const uint32_t * disp, uint32_t num_buckets,
+                          uint32_t table_size, const char * key, size_t len) {
+    uint32_t b = PHashString(key, len, 0) & (num_buckets - 1);
+    return PHashString(key, len, disp[b]) & (table_size - 1);
+}
+
+#endif // PHASH_H
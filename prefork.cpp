@@ -0,0 +1,396 @@
+#include "httpd.h"
+#include "prefork.h"
+#include "upgrade.h"
+#include <dirent.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <new>
+
+using namespace std;
+
+typedef struct worker_slot {
+    pid_t pid;
+    time_t started;
+    time_t respawn;             // when to fork the slot's worker again, 0 if not due
+    cpu_set_t cpus;
+    int pinned;
+} worker_slot;
+
+// counters for the single-process server, replaced by a shared slot in workers
+static struct worker_stats local_stats;
+struct worker_stats * my_stats = &local_stats;
+
+static volatile sig_atomic_t dump_stats = 0;
+static volatile sig_atomic_t stop_workers = 0;
+static volatile sig_atomic_t forward_hup = 0;
+
+
+static void HandleSigusr1(int) {
+    dump_stats = 1;
+}
+
+
+static void HandleStop(int) {
+    stop_workers = 1;
+}
+
+
+static void HandleHup(int) {
+    forward_hup = 1;
+}
+
+
+// only there to end sigsuspend() when a worker exits
+static void HandleChild(int) {
+}
+
+
+/*
+ *  Parse a sysfs cpulist such as "0-3,8-11" into a cpu set.
+ */
+static void ParseCpuList(string list, cpu_set_t * cpus) {
+
+    CPU_ZERO(cpus);
+    size_t pos = 0;
+    while (pos < list.size()) {
+        size_t comma = list.find(',', pos);
+        string range = list.substr(pos, comma == string::npos ? string::npos : comma - pos);
+        int lo = atoi(range.c_str());
+        int hi = lo;
+        if (range.find('-') != string::npos) {
+            hi = atoi(range.substr(range.find('-') + 1).c_str());
+        }
+        for (int c = lo; c <= hi && c < CPU_SETSIZE; c++) {
+            CPU_SET(c, cpus);
+        }
+        if (comma == string::npos) {
+            break;
+        }
+        pos = comma + 1;
+    }
+}
+
+
+/*
+ *  Read the cpus of every NUMA node from sysfs.
+ *  Returns the number of nodes found (0 on non-NUMA kernels).
+ */
+static int GetNumaNodes(vector<cpu_set_t> & nodes) {
+
+    DIR * dir = opendir("/sys/devices/system/node");
+    if (dir == NULL) {
+        return 0;
+    }
+    vector<int> ids;
+    struct dirent * ent;
+    while ((ent = readdir(dir)) != NULL) {
+        if (strncmp(ent->d_name, "node", 4) == 0 && isdigit(ent->d_name[4])) {
+            ids.push_back(atoi(ent->d_name + 4));
+        }
+    }
+    closedir(dir);
+    sort(ids.begin(), ids.end());
+    for (size_t i = 0; i < ids.size(); i++) {
+        ifstream infile(("/sys/devices/system/node/node" + to_string(ids[i]) + "/cpulist").c_str());
+        string list;
+        if (getline(infile, list) && !list.empty()) {
+            cpu_set_t cpus;
+            ParseCpuList(list, &cpus);
+            nodes.push_back(cpus);
+        }
+    }
+    return nodes.size();
+}
+
+
+static void PrintStats(struct worker_stats * stats, int num_workers) {
+
+    uint64_t total[8] = { 0 };
+    cerr << "worker     pid  restarts  connections  requests     2xx     3xx     4xx     5xx  bytes_sent" << endl;
+    for (int i = 0; i < num_workers; i++) {
+        struct worker_stats & w = stats[i];
+        uint64_t row[8] = {
+            w.connections.load(memory_order_relaxed), w.requests.load(memory_order_relaxed),
+            w.responses[1].load(memory_order_relaxed), w.responses[2].load(memory_order_relaxed),
+            w.responses[3].load(memory_order_relaxed), w.responses[4].load(memory_order_relaxed),
+            w.bytes_sent.load(memory_order_relaxed), w.restarts
+        };
+        char line[160];
+        snprintf(line, sizeof(line), "%6d %7d %9llu %12llu %9llu %7llu %7llu %7llu %7llu %11llu",
+                 i, (int)w.pid, (unsigned long long)row[7],
+                 (unsigned long long)row[0], (unsigned long long)row[1],
+                 (unsigned long long)row[2], (unsigned long long)row[3],
+                 (unsigned long long)row[4], (unsigned long long)row[5],
+                 (unsigned long long)row[6]);
+        cerr << line << endl;
+        for (int k = 0; k < 8; k++) {
+            total[k] += row[k];
+        }
+    }
+    char line[160];
+    snprintf(line, sizeof(line), " total         %9llu %12llu %9llu %7llu %7llu %7llu %7llu %11llu",
+             (unsigned long long)total[7],
+             (unsigned long long)total[0], (unsigned long long)total[1],
+             (unsigned long long)total[2], (unsigned long long)total[3],
+             (unsigned long long)total[4], (unsigned long long)total[5],
+             (unsigned long long)total[6]);
+    cerr << line << endl;
+}
+
+
+static int LiveWorkers(const vector<struct worker_slot> & slots) {
+
+    int n = 0;
+    for (size_t i = 0; i < slots.size(); i++) {
+        n += slots[i].pid > 0;
+    }
+    return n;
+}
+
+
+static pid_t SpawnWorker(int listen_fd, string doc_root, int idx,
+                         struct worker_slot * slot, struct worker_stats * stats) {
+
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid > 0) {
+            slot->pid = pid;
+            slot->started = time(NULL);
+            stats[idx].pid = pid;
+        }
+        return pid;
+    }
+
+    // worker: drop the master's signal handling and serve
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    sigset_t none;
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    if (slot->pinned && sched_setaffinity(0, sizeof(slot->cpus), &slot->cpus) != 0) {
+        cerr << "worker " << idx << ": sched_setaffinity() failed" << endl;
+    }
+    my_stats = &stats[idx];
+    DisableHandoff();
+    ServeConnections(listen_fd, doc_root);
+    _exit(0);
+}
+
+
+/*
+ *  Fork the worker of slot idx, or if that fails, try again in
+ *  PREFORK_BACKOFF_SECS. Returns the pid or -1.
+ */
+static pid_t RespawnWorker(int listen_fd, string doc_root, int idx,
+                           struct worker_slot * slot, struct worker_stats * stats) {
+
+    pid_t pid = SpawnWorker(listen_fd, doc_root, idx, slot, stats);
+    if (pid < 0) {
+        cerr << "prefork: fork() failed for worker " << idx << ", retrying in "
+             << PREFORK_BACKOFF_SECS << "s" << endl;
+        slot->respawn = time(NULL) + PREFORK_BACKOFF_SECS;
+    }
+    else {
+        slot->respawn = 0;
+    }
+    return pid;
+}
+
+
+/*
+ *  Run num_workers copies of the accept loop on listen_fd and supervise
+ *  them. With numa set, one worker is started per NUMA node and pinned to
+ *  that node's cpus. A worker that can't be forked, at first or after
+ *  it died, is retried every PREFORK_BACKOFF_SECS. Returns 0 when the
+ *  workers have exited after SIGTERM or after an upgrade handed the
+ *  listener to a new master, -1 if no worker could be started at all.
+ */
+int RunPrefork(int listen_fd, string doc_root, int num_workers, int numa) {
+
+    vector<cpu_set_t> nodes;
+    if (numa) {
+        num_workers = GetNumaNodes(nodes);
+        if (num_workers == 0) {
+            cerr << "no NUMA nodes found, starting a single worker" << endl;
+            num_workers = 1;
+        }
+    }
+    if (num_workers < 1 || num_workers > PREFORK_MAX_WORKERS) {
+        cerr << "invalid number of workers: " << num_workers << endl;
+        return -1;
+    }
+
+    // counters shared with the workers, one cache line apart
+    void * mem = mmap(NULL, sizeof(struct worker_stats) * num_workers, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) {
+        cerr << "mmap() failed for worker stats" << endl;
+        return -1;
+    }
+    struct worker_stats * stats = new (mem) struct worker_stats[num_workers]();
+    vector<struct worker_slot> slots(num_workers);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = HandleSigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = HandleStop;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    sa.sa_handler = HandleHup;
+    sigaction(SIGHUP, &sa, NULL);
+    sa.sa_handler = HandleChild;
+    sigaction(SIGCHLD, &sa, NULL);
+    InstallUpgradeHandler();
+
+    // the signals are only let in by sigsuspend(), after their flags have
+    // been checked, so none can arrive unnoticed just before we wait
+    sigset_t held, waiting, saved;
+    sigemptyset(&held);
+    sigaddset(&held, SIGUSR1);
+    sigaddset(&held, SIGUSR2);
+    sigaddset(&held, SIGTERM);
+    sigaddset(&held, SIGINT);
+    sigaddset(&held, SIGHUP);
+    sigaddset(&held, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &held, &saved);
+    waiting = saved;
+    sigdelset(&waiting, SIGUSR1);
+    sigdelset(&waiting, SIGUSR2);
+    sigdelset(&waiting, SIGTERM);
+    sigdelset(&waiting, SIGINT);
+    sigdelset(&waiting, SIGHUP);
+    sigdelset(&waiting, SIGCHLD);
+
+    int started = 0;
+    for (int i = 0; i < num_workers; i++) {
+        slots[i].pinned = numa && i < (int)nodes.size();
+        if (slots[i].pinned) {
+            slots[i].cpus = nodes[i];
+        }
+        started += RespawnWorker(listen_fd, doc_root, i, &slots[i], stats) > 0;
+    }
+    if (started == 0) {
+        cerr << "prefork: no worker could be started" << endl;
+        sigprocmask(SIG_SETMASK, &saved, NULL);
+        munmap(mem, sizeof(struct worker_stats) * num_workers);
+        return -1;
+    }
+    cerr << "prefork: started " << started << " of " << num_workers << " workers" << endl;
+    UpgradeReady();
+
+    // waitpid(-1) rather than ECHILD decides nothing here: after an
+    // upgrade the new master is our child too, so count workers instead
+    int stopping = 0;
+    while (!stopping || LiveWorkers(slots) > 0) {
+        if (dump_stats) {
+            dump_stats = 0;
+            PrintStats(stats, num_workers);
+        }
+        // workers each map the archive, so each has to reopen it
+        if (forward_hup) {
+            forward_hup = 0;
+            for (int i = 0; i < num_workers; i++) {
+                if (slots[i].pid > 0) {
+                    kill(slots[i].pid, SIGHUP);
+                }
+            }
+        }
+        // after a handoff (or on SIGTERM) let the workers finish and exit
+        int drain = !stopping && CheckUpgrade();
+        if ((drain || stop_workers) && !stopping) {
+            stopping = 1;
+            for (int i = 0; i < num_workers; i++) {
+                if (slots[i].pid > 0) {
+                    kill(slots[i].pid, drain ? SIGUSR2 : SIGTERM);
+                }
+            }
+        }
+
+        // fork the workers that are due, and wake up for the next one
+        time_t now = time(NULL);
+        time_t next = 0;
+        for (int i = 0; i < num_workers && !stopping; i++) {
+            if (slots[i].respawn != 0 && slots[i].respawn <= now) {
+                RespawnWorker(listen_fd, doc_root, i, &slots[i], stats);
+            }
+            if (slots[i].respawn != 0 && (next == 0 || slots[i].respawn < next)) {
+                next = slots[i].respawn;
+            }
+        }
+
+        int status;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+        // ECHILD: every worker died and none could be forked again yet
+        if (pid == 0 || (pid < 0 && errno == ECHILD)) {
+            // sigsuspend() with a timeout
+            struct timespec timeout = { next - now, 0 };
+            ppoll(NULL, 0, next != 0 ? &timeout : NULL, &waiting);
+            continue;
+        }
+        if (pid < 0 && errno == EINTR) {
+            continue;
+        }
+        if (pid < 0) {
+            cerr << "prefork: waitpid() failed" << endl;
+            break;
+        }
+
+        int idx;
+        for (idx = 0; idx < num_workers && slots[idx].pid != pid; idx++);
+        if (idx == num_workers) {
+            continue;
+        }
+        slots[idx].pid = 0;
+        if (stopping) {
+            continue;
+        }
+        if (WIFSIGNALED(status)) {
+            cerr << "prefork: worker " << idx << " (pid " << pid << ") killed by signal "
+                 << WTERMSIG(status) << ", restarting" << endl;
+        }
+        else {
+            cerr << "prefork: worker " << idx << " (pid " << pid << ") exited with "
+                 << WEXITSTATUS(status) << ", restarting" << endl;
+        }
+        // don't spin if a worker dies right away every time
+        now = time(NULL);
+        slots[idx].respawn = now - slots[idx].started < PREFORK_BACKOFF_SECS ?
+                             now + PREFORK_BACKOFF_SECS : now;
+        stats[idx].restarts++;
+    }
+
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+    PrintStats(stats, num_workers);
+    munmap(mem, sizeof(struct worker_stats) * num_workers);
+    return 0;
+}
+
+
+/*
+ *  Without a master, SIGUSR1 has the server print its own counters from
+ *  the accept loop (see CheckStats) rather than kill it.
+ */
+void InstallStatsHandler() {
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = HandleSigusr1;
+    sigaction(SIGUSR1, &sa, NULL);
+}
+
+
+void CheckStats() {
+
+    if (dump_stats) {
+        dump_stats = 0;
+        my_stats->pid = getpid();
+        PrintStats(my_stats, 1);
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef PREFORK_H
+#define PREFORK_H
+
+#include <atomic>
+#include <stdint.h>
+#include <string>
+#include <sys/types.h>
+
+/*
+ *  Prefork mode: the master binds the listening socket, forks workers that
+ *  each run the normal accept loop, and restarts any worker that dies.
+ *  Every worker owns one cache-line sized slot of counters in a shared
+ *  anonymous mapping; the master sums them up on SIGUSR1. A server
+ *  without workers prints its own counters on SIGUSR1.
+ */
+#define PREFORK_MAX_WORKERS 256
+#define PREFORK_BACKOFF_SECS 1
+
+typedef struct alignas(64) worker_stats {
+    std::atomic<uint64_t> connections;
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> responses[5];     // 1xx .. 5xx
+    std::atomic<uint64_t> bytes_sent;
+    pid_t pid;
+    uint32_t restarts;
+} worker_stats;
+
+extern struct worker_stats * my_stats;
+
+int RunPrefork(int listen_fd, std::string doc_root, int num_workers, int numa);
+void InstallStatsHandler();
+void CheckStats();
+
+inline void CountConnection() {
+    my_stats->connections.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline void CountRequest(int response_code) {
+    my_stats->requests.fetch_add(1, std::memory_order_relaxed);
+    if (response_code >= 100 && response_code < 600) {
+        my_stats->responses[response_code / 100 - 1].fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+inline void CountBytes(size_t n) {
+    my_stats->bytes_sent.fetch_add(n, std::memory_order_relaxed);
+}
+
+#endif // PREFORK_H
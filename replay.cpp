@@ -0,0 +1,366 @@
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <deque>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <netinet/tcp.h>
+#include "httpd.h"
+#include "capture.h"
+
+/*
+ *  Replays a trace captured with httpd -c against a running server:
+ *
+ *      replay [-f] [-t timeout_ms] trace_file host port
+ *
+ *  Connections are opened, written to and closed in trace order, at the
+ *  original pacing or, with -f, as fast as the server answers. A request
+ *  is only sent once the responses that preceded it on its connection
+ *  have arrived, as they had in the capture. Every response's status and
+ *  size is compared with what the server sent when it was recorded.
+ */
+
+using namespace std;
+
+#define REPLAY_TIMEOUT_MS 5000
+
+typedef struct expected_res {
+    uint32_t status;
+    uint64_t bytes;
+} expected_res;
+
+typedef struct replay_conn {
+    int fd;
+    int closing;
+    string inbuf;
+    deque<struct expected_res> expected;
+} replay_conn;
+
+typedef struct replay_stats {
+    uint64_t conns;
+    uint64_t requests;
+    uint64_t matched;
+    uint64_t status_mismatch;
+    uint64_t size_mismatch;
+    uint64_t missing;
+    uint64_t unexpected;
+    uint64_t failed;
+} replay_stats;
+
+typedef struct replay_rec {
+    struct trace_rec rec;
+    const char * payload;
+    vector<struct expected_res> expect;     // responses this data drew
+} replay_rec;
+
+static map<uint64_t, struct replay_conn> conns;
+static struct replay_stats stats;
+
+
+static uint64_t NowUsec() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+static void CloseConn(uint64_t id) {
+
+    struct replay_conn & c = conns[id];
+    stats.missing += c.expected.size();
+    if (!c.expected.empty()) {
+        cerr << "conn " << hex << id << dec << ": " << c.expected.size()
+             << " response(s) never arrived" << endl;
+    }
+    if (c.fd >= 0) {
+        close(c.fd);
+    }
+    conns.erase(id);
+}
+
+
+/*
+ *  Pull every complete response out of the connection's input buffer and
+ *  check it against the next expected one.
+ */
+static void ParseResponses(uint64_t id, struct replay_conn & c) {
+
+    while (1) {
+        uint32_t status;
+        uint64_t bytes = TraceResponseSize(c.inbuf.data(), c.inbuf.size(), &status);
+        if (bytes == 0) {
+            return;
+        }
+        c.inbuf.erase(0, bytes);
+
+        if (c.expected.empty()) {
+            cerr << "conn " << hex << id << dec << ": unexpected " << status << " response" << endl;
+            stats.unexpected++;
+            continue;
+        }
+        struct expected_res want = c.expected.front();
+        c.expected.pop_front();
+        if (want.status != status) {
+            cerr << "conn " << hex << id << dec << ": expected status " << want.status
+                 << " but was " << status << endl;
+            stats.status_mismatch++;
+        }
+        else if (want.bytes != bytes) {
+            cerr << "conn " << hex << id << dec << ": expected " << want.bytes
+                 << " bytes but was " << bytes << endl;
+            stats.size_mismatch++;
+        }
+        else {
+            stats.matched++;
+        }
+    }
+}
+
+
+/*
+ *  Read whatever the server has sent on any connection, waiting at most
+ *  timeout_ms for something to arrive.
+ */
+static void PumpIO(int timeout_ms) {
+
+    vector<struct pollfd> pfds;
+    vector<uint64_t> ids;
+    for (map<uint64_t, struct replay_conn>::iterator it = conns.begin(); it != conns.end(); it++) {
+        struct pollfd p;
+        p.fd = it->second.fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        pfds.push_back(p);
+        ids.push_back(it->first);
+    }
+    if (pfds.empty()) {
+        if (timeout_ms > 0) {
+            usleep(timeout_ms * 1000);
+        }
+        return;
+    }
+    if (poll(&pfds[0], pfds.size(), timeout_ms) <= 0) {
+        return;
+    }
+    for (size_t i = 0; i < pfds.size(); i++) {
+        if (pfds[i].revents == 0) {
+            continue;
+        }
+        struct replay_conn & c = conns[ids[i]];
+        char buffer[65536];
+        ssize_t n = recv(c.fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n > 0) {
+            c.inbuf.append(buffer, n);
+            ParseResponses(ids[i], c);
+            if (c.closing && c.expected.empty()) {
+                CloseConn(ids[i]);
+            }
+        }
+        else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            // server closed the connection
+            CloseConn(ids[i]);
+        }
+    }
+}
+
+
+/*
+ *  Wait until the connection has no responses outstanding.
+ */
+static void WaitForResponses(uint64_t id, int timeout_ms) {
+
+    uint64_t deadline = NowUsec() + (uint64_t)timeout_ms * 1000;
+    while (conns.count(id) && !conns[id].expected.empty() && NowUsec() < deadline) {
+        PumpIO((deadline - NowUsec()) / 1000 + 1);
+    }
+}
+
+
+static int Connect(const char * host, const char * port) {
+
+    struct addrinfo hints, *addrs;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &addrs) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo * a = addrs; a != NULL; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(addrs);
+    if (fd >= 0) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+
+void usage(char * argv0)
+{
+    cerr << "Usage: " << argv0 << " [-f] [-t timeout_ms] trace_file host port" << endl;
+}
+
+int main(int argc, char *argv[])
+{
+    int fast = 0;
+    int timeout_ms = REPLAY_TIMEOUT_MS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "ft:")) != -1) {
+        switch (opt) {
+            case 'f':
+                fast = 1;
+                break;
+            case 't':
+                timeout_ms = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind != 3) {
+            usage(argv[0]);
+            return 1;
+    }
+    const char * host = argv[optind + 1];
+    const char * port = argv[optind + 2];
+
+    ifstream infile(argv[optind], ios::binary);
+    string trace((istreambuf_iterator<char>(infile)), istreambuf_iterator<char>());
+    if (trace.size() < 8 || trace.compare(0, 8, TRACE_MAGIC) != 0) {
+        cerr << argv[optind] << " is not a trace file" << endl;
+        return 2;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // index the trace and hang every response off the request it answered,
+    // so its expectation is in place before the reply can possibly arrive
+    vector<struct replay_rec> recs;
+    map<uint64_t, size_t> last_data;
+    size_t pos = 8;
+    while (pos + sizeof(struct trace_rec) <= trace.size()) {
+        struct replay_rec r;
+        memcpy(&r.rec, trace.data() + pos, sizeof(r.rec));
+        pos += sizeof(r.rec);
+        if (pos + r.rec.len > trace.size()) {
+            cerr << "trace is truncated" << endl;
+            break;
+        }
+        r.payload = trace.data() + pos;
+        pos += r.rec.len;
+        if (r.rec.type == TRACE_RESPONSE) {
+            if (last_data.count(r.rec.conn)) {
+                struct expected_res want = { r.rec.status, r.rec.bytes };
+                recs[last_data[r.rec.conn]].expect.push_back(want);
+            }
+            continue;
+        }
+        if (r.rec.type == TRACE_DATA) {
+            last_data[r.rec.conn] = recs.size();
+        }
+        recs.push_back(r);
+    }
+
+    // prefork workers share the trace, so records can be slightly out of
+    // order; one written before the first is simply due right away
+    uint64_t first_usec = recs.empty() ? 0 : recs.front().rec.usec;
+    uint64_t last_usec = first_usec;
+    for (size_t i = 0; i < recs.size(); i++) {
+        last_usec = max(last_usec, recs[i].rec.usec);
+    }
+    uint64_t start = NowUsec();
+    for (size_t i = 0; i < recs.size(); i++) {
+        const struct trace_rec & rec = recs[i].rec;
+
+        // keep the original spacing between records unless asked not to
+        if (!fast) {
+            uint64_t due = rec.usec < first_usec ? start : start + (rec.usec - first_usec);
+            while (NowUsec() < due) {
+                PumpIO((due - NowUsec()) / 1000 + 1);
+            }
+        }
+        else {
+            PumpIO(0);
+        }
+
+        switch (rec.type) {
+            case TRACE_OPEN: {
+                struct replay_conn c;
+                c.fd = Connect(host, port);
+                c.closing = 0;
+                if (c.fd < 0) {
+                    cerr << "connect() failed" << endl;
+                    stats.failed++;
+                    break;
+                }
+                conns[rec.conn] = c;
+                stats.conns++;
+                break;
+            }
+            case TRACE_DATA:
+                if (!conns.count(rec.conn)) {
+                    stats.failed++;
+                    break;
+                }
+                WaitForResponses(rec.conn, timeout_ms);
+                if (!conns.count(rec.conn) ||
+                    send(conns[rec.conn].fd, recs[i].payload, rec.len, MSG_NOSIGNAL) != (ssize_t)rec.len) {
+                    cerr << "send() failed" << endl;
+                    stats.failed++;
+                    break;
+                }
+                conns[rec.conn].expected.insert(conns[rec.conn].expected.end(),
+                                                recs[i].expect.begin(), recs[i].expect.end());
+                stats.requests += recs[i].expect.size();
+                break;
+            case TRACE_CLOSE:
+                if (conns.count(rec.conn)) {
+                    conns[rec.conn].closing = 1;
+                    if (conns[rec.conn].expected.empty()) {
+                        CloseConn(rec.conn);
+                    }
+                }
+                break;
+        }
+    }
+
+    // collect the stragglers
+    uint64_t deadline = NowUsec() + (uint64_t)timeout_ms * 1000;
+    while (!conns.empty() && NowUsec() < deadline) {
+        int pending = 0;
+        for (map<uint64_t, struct replay_conn>::iterator it = conns.begin(); it != conns.end(); it++) {
+            pending += it->second.expected.size();
+        }
+        if (pending == 0) {
+            break;
+        }
+        PumpIO((deadline - NowUsec()) / 1000 + 1);
+    }
+    while (!conns.empty()) {
+        CloseConn(conns.begin()->first);
+    }
+
+    uint64_t elapsed = NowUsec() - start;
+    cout << "replayed " << stats.conns << " connections, " << stats.requests << " requests in "
+         << elapsed / 1000 << " ms (captured over " << (last_usec - first_usec) / 1000 << " ms)" << endl;
+    cout << "matched " << stats.matched << ", status mismatch " << stats.status_mismatch
+         << ", size mismatch " << stats.size_mismatch << ", missing " << stats.missing
+         << ", unexpected " << stats.unexpected << ", failed " << stats.failed << endl;
+
+    return stats.matched == stats.requests && stats.status_mismatch + stats.size_mismatch +
+           stats.missing + stats.unexpected + stats.failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,324 @@
+#include <iostream>
+#include <fstream>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+#include "httpd.h"
+#include "sockopt.h"
+
+/*
+ *  Measures what the socket options of sockopt.h do to request latency
+ *  on loopback:
+ *
+ *      sockbench [-n requests] [-p port] [-o profile]... docroot_dir [uri]
+ *
+ *  Each profile (by default the baseline, then each option on its own,
+ *  then the latency preset) gets a fresh server in a child process.
+ *  Requests for uri are timed two ways: back to back on one kept-alive
+ *  connection, and each on a connection of its own, which is where
+ *  TCP_DEFER_ACCEPT and TCP_FASTOPEN come in. The report has the median,
+ *  p99 and mean of both, and how far each median is from the first
+ *  profile's.
+ */
+
+using namespace std;
+
+#define BENCH_REQUESTS  2000
+#define BENCH_WARMUP    100
+#define BENCH_PORT      8089
+#define BENCH_START_MS  2000
+
+static const char * default_profiles[] = {
+    "default",
+    "nonodelay",
+    "defer_accept=1",
+    "fastopen=256",
+    "busy_poll=50",
+    "notsent_lowat=16384",
+    "sndbuf=4194304,rcvbuf=4194304",
+    "ipv6",
+    "latency",
+};
+
+typedef struct bench_result {
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t mean;
+} bench_result;
+
+
+static uint64_t NowUsec() {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/*
+ *  Run a server with profile p in a child, quietly. Returns its pid.
+ */
+static pid_t StartServer(unsigned short port, string doc_root, struct sock_profile * p) {
+
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+    // the server logs every request; keep that off the report
+    int null_fd = open("/dev/null", O_WRONLY);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+    struct httpd_conf conf;
+    memset(&conf, 0, sizeof(conf));
+    conf.slow_ms = -1;
+    conf.sock = *p;
+    start_httpd(port, doc_root, &conf);
+    _exit(1);
+}
+
+
+static int Connect(unsigned short port, int fastopen) {
+
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd < 0) {
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (fastopen) {
+        // the request goes out in the SYN once we hold a cookie
+        setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one));
+    }
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+
+/*
+ *  Send one request and read the whole response. With until_eof, the
+ *  response ends when the server closes. Returns 0 for a 200; status
+ *  gets the status line, empty if none came back.
+ */
+static int Request(int fd, const string & request, int until_eof, string & status) {
+
+    // small enough for one send() on a fresh connection
+    if (send(fd, request.data(), request.size(), 0) != (ssize_t)request.size()) {
+        return -1;
+    }
+    string in;
+    char buffer[16384];
+    size_t end = string::npos;
+    long long length = -1;
+    while (1) {
+        if (end == string::npos && (end = in.find("\r\n\r\n")) != string::npos) {
+            end += 4;
+            size_t cl = in.find("Content-Length: ");
+            length = cl < end ? atoll(in.c_str() + cl + 16) : 0;
+        }
+        if (!until_eof && end != string::npos && in.size() >= end + length) {
+            break;
+        }
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        in.append(buffer, n);
+    }
+    status = in.substr(0, in.find("\r\n"));
+    if (end == string::npos || in.size() < end + length || in.compare(0, 12, "HTTP/1.1 200")) {
+        return -1;
+    }
+    return 0;
+}
+
+
+static struct bench_result Summarize(vector<uint64_t> & samples) {
+
+    struct bench_result r = { 0, 0, 0 };
+    if (samples.empty()) {
+        return r;
+    }
+    sort(samples.begin(), samples.end());
+    uint64_t total = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        total += samples[i];
+    }
+    r.p50 = samples[samples.size() / 2];
+    r.p99 = samples[samples.size() * 99 / 100];
+    r.mean = total / samples.size();
+    return r;
+}
+
+
+/*
+ *  Time requests on one kept-alive connection (per_conn 0) or on a new
+ *  connection each (per_conn 1). Returns -1 if any request failed.
+ */
+static int Measure(unsigned short port, string uri, int requests, int per_conn,
+                   int fastopen, struct bench_result * result) {
+
+    string request = "GET " + uri + " HTTP/1.1\r\nHost: localhost\r\n";
+    request += per_conn ? "Connection: close\r\n\r\n" : "\r\n";
+    vector<uint64_t> samples;
+    int fd = per_conn ? -1 : Connect(port, 0);
+    for (int i = 0; i < BENCH_WARMUP + requests; i++) {
+        uint64_t start = NowUsec();
+        if (per_conn) {
+            fd = Connect(port, fastopen);
+        }
+        string status;
+        if (fd < 0 || Request(fd, request, per_conn, status) != 0) {
+            cerr << "request " << i << " failed: "
+                 << (fd < 0 ? "cannot connect" : status.empty() ? "no response" : status) << endl;
+            if (fd >= 0) {
+                close(fd);
+            }
+            return -1;
+        }
+        if (per_conn) {
+            close(fd);
+        }
+        if (i >= BENCH_WARMUP) {
+            samples.push_back(NowUsec() - start);
+        }
+    }
+    if (!per_conn) {
+        close(fd);
+    }
+    *result = Summarize(samples);
+    return 0;
+}
+
+
+static string Delta(uint64_t value, uint64_t base) {
+
+    if (base == 0) {
+        return "";
+    }
+    char buffer[16];
+    snprintf(buffer, sizeof(buffer), "%+.1f%%", (double)value * 100 / base - 100);
+    return buffer;
+}
+
+
+static void usage(char * argv0) {
+
+    cerr << "Usage: " << argv0 << " [-n requests] [-p port] [-o socket_profile]..."
+         << " docroot_dir [uri]" << endl;
+}
+
+
+int main(int argc, char *argv[]) {
+
+    int requests = BENCH_REQUESTS;
+    unsigned short port = BENCH_PORT;
+    vector<string> profiles;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:p:o:")) != -1) {
+        switch (opt) {
+            case 'n':
+                if ((requests = atoi(optarg)) <= 0) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                break;
+            case 'p': {
+                long int p = strtol(optarg, NULL, 10);
+                if (p <= 0 || p > USHRT_MAX) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                port = p;
+                break;
+            }
+            case 'o':
+                profiles.push_back(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (argc - optind < 1 || argc - optind > 2) {
+        usage(argv[0]);
+        return 1;
+    }
+    // CheckFile matches files against the resolved docroot
+    char root[PATH_MAX];
+    if (realpath(argv[optind], root) == NULL) {
+        cerr << "cannot resolve docroot " << argv[optind] << ": " << strerror(errno) << endl;
+        return 1;
+    }
+    string doc_root = root;
+    string uri = argc - optind == 2 ? argv[optind + 1] : "/index.html";
+    if (profiles.empty()) {
+        profiles.assign(default_profiles,
+                        default_profiles + sizeof(default_profiles) / sizeof(default_profiles[0]));
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    // fastopen only shortens the handshake if the server side is enabled
+    int tfo_sysctl = 0;
+    ifstream("/proc/sys/net/ipv4/tcp_fastopen") >> tfo_sysctl;
+
+    printf("%d requests per run, %s\n\n", requests, uri.c_str());
+    printf("%-30s %27s %27s\n", "", "kept-alive (us)", "new connection (us)");
+    printf("%-30s %6s %6s %6s %7s %6s %6s %6s %7s\n", "profile",
+           "p50", "p99", "mean", "vs p50", "p50", "p99", "mean", "vs p50");
+    struct bench_result base[2] = { { 0, 0, 0 }, { 0, 0, 0 } };
+    for (size_t i = 0; i < profiles.size(); i++) {
+        struct sock_profile p;
+        DefaultSockProfile(&p);
+        if (ParseSockProfile(profiles[i].c_str(), &p) != 0) {
+            return 1;
+        }
+        pid_t pid = StartServer(port, doc_root, &p);
+        // wait for it to listen
+        int fd = -1;
+        for (int ms = 0; ms < BENCH_START_MS && fd < 0; ms += 10) {
+            usleep(10000);
+            fd = Connect(port, 0);
+        }
+        int rc = -1;
+        struct bench_result r[2];
+        if (fd >= 0) {
+            close(fd);
+            rc = Measure(port, uri, requests, 0, 0, &r[0]);
+            if (rc == 0) {
+                rc = Measure(port, uri, requests, 1, p.fastopen, &r[1]);
+            }
+        }
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        if (rc != 0) {
+            printf("%-30s failed\n", profiles[i].c_str());
+            continue;
+        }
+        if (i == 0) {
+            base[0] = r[0];
+            base[1] = r[1];
+        }
+        printf("%-30s %6llu %6llu %6llu %7s %6llu %6llu %6llu %7s\n", profiles[i].c_str(),
+               (unsigned long long)r[0].p50, (unsigned long long)r[0].p99,
+               (unsigned long long)r[0].mean, Delta(r[0].p50, base[0].p50).c_str(),
+               (unsigned long long)r[1].p50, (unsigned long long)r[1].p99,
+               (unsigned long long)r[1].mean, Delta(r[1].p50, base[1].p50).c_str());
+        if (p.fastopen && !(tfo_sysctl & 2)) {
+            printf("%-30s (net.ipv4.tcp_fastopen = %d, server side off)\n", "", tfo_sysctl);
+        }
+    }
+    return 0;
+}
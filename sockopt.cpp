@@ -0,0 +1,188 @@
+#include "httpd.h"
+#include "sockopt.h"
+#include <netinet/tcp.h>
+
+using namespace std;
+
+typedef struct sock_option {
+    const char * name;
+    size_t offset;              // of the int in sock_profile
+    int takes_value;            // name=value; otherwise a flag
+} sock_option;
+
+static const struct sock_option options[] = {
+    { "ipv6", offsetof(struct sock_profile, ipv6), 0 },
+    { "nodelay", offsetof(struct sock_profile, nodelay), 0 },
+    { "defer_accept", offsetof(struct sock_profile, defer_accept), 1 },
+    { "fastopen", offsetof(struct sock_profile, fastopen), 1 },
+    { "sndbuf", offsetof(struct sock_profile, sndbuf), 1 },
+    { "rcvbuf", offsetof(struct sock_profile, rcvbuf), 1 },
+    { "busy_poll", offsetof(struct sock_profile, busy_poll), 1 },
+    { "notsent_lowat", offsetof(struct sock_profile, notsent_lowat), 1 },
+    { "backlog", offsetof(struct sock_profile, backlog), 1 },
+};
+
+
+void DefaultSockProfile(struct sock_profile * p) {
+
+    memset(p, 0, sizeof(*p));
+    // a restarted server must be able to bind while old connections
+    // are still in TIME_WAIT
+    p->reuseaddr = 1;
+    // the header goes out with send() and the body with sendfile(), so
+    // with Nagle's algorithm on a keep-alive response stalls on the
+    // client's delayed ACK
+    p->nodelay = 1;
+    // a burst of new connections must not overflow the accept queue
+    p->backlog = SOCK_BACKLOG;
+}
+
+
+/*
+ *  Apply spec (see sockopt.h) on top of p. Returns 0 on success, -1 for
+ *  an unknown option or a bad value.
+ */
+int ParseSockProfile(const char * spec, struct sock_profile * p) {
+
+    string rest(spec);
+    while (!rest.empty()) {
+        size_t comma = rest.find(',');
+        string item = rest.substr(0, comma);
+        rest = comma == string::npos ? "" : rest.substr(comma + 1);
+        if (item.empty()) {
+            continue;
+        }
+        if (item == "default") {
+            DefaultSockProfile(p);
+            continue;
+        }
+        if (item == "latency" || item == "throughput") {
+            if (ParseSockProfile(item == "latency" ? SOCK_LATENCY : SOCK_THROUGHPUT, p) != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (item == "noreuseaddr") {
+            p->reuseaddr = 0;
+            continue;
+        }
+        if (item == "nonodelay") {
+            p->nodelay = 0;
+            continue;
+        }
+
+        size_t eq = item.find('=');
+        string name = item.substr(0, eq);
+        size_t i = 0;
+        while (i < sizeof(options) / sizeof(options[0]) && name != options[i].name) {
+            i++;
+        }
+        if (i == sizeof(options) / sizeof(options[0]) ||
+            (eq != string::npos) != (options[i].takes_value != 0)) {
+            cerr << "unknown socket option: " << item << endl;
+            return -1;
+        }
+        int value = 1;
+        if (eq != string::npos) {
+            char * end;
+            long v = strtol(item.c_str() + eq + 1, &end, 10);
+            if (*end != '\0' || end == item.c_str() + eq + 1 || v < 0 || v > INT_MAX) {
+                cerr << "bad value for socket option: " << item << endl;
+                return -1;
+            }
+            value = v;
+        }
+        *(int *)((char *)p + options[i].offset) = value;
+    }
+    return 0;
+}
+
+
+static void SetOption(int fd, int level, int name, int value, const char * what) {
+
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0) {
+        cerr << "setsockopt(" << what << ") failed: " << strerror(errno) << endl;
+    }
+}
+
+
+/*
+ *  Set the tuning options of p on a listening socket, new (before bind())
+ *  or inherited from an upgrading server, whose backlog is updated too.
+ *  Every option is set, off or on, so none survives from the old server's
+ *  profile. Failures are reported but not fatal.
+ */
+void TuneListener(int fd, const struct sock_profile * p) {
+
+    SetOption(fd, SOL_SOCKET, SO_REUSEADDR, p->reuseaddr != 0, "SO_REUSEADDR");
+    SetOption(fd, IPPROTO_TCP, TCP_NODELAY, p->nodelay != 0, "TCP_NODELAY");
+    SetOption(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, p->defer_accept, "TCP_DEFER_ACCEPT");
+    SetOption(fd, IPPROTO_TCP, TCP_FASTOPEN, p->fastopen, "TCP_FASTOPEN");
+    // buffer sizes must be set before listen() to affect window scaling;
+    // there is no setting them back to autotuned, so 0 leaves them be
+    if (p->sndbuf) {
+        SetOption(fd, SOL_SOCKET, SO_SNDBUF, p->sndbuf, "SO_SNDBUF");
+    }
+    if (p->rcvbuf) {
+        SetOption(fd, SOL_SOCKET, SO_RCVBUF, p->rcvbuf, "SO_RCVBUF");
+    }
+    SetOption(fd, SOL_SOCKET, SO_BUSY_POLL, p->busy_poll, "SO_BUSY_POLL");
+    // 0 is net.ipv4.tcp_notsent_lowat, which is unlimited by default
+    SetOption(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p->notsent_lowat, "TCP_NOTSENT_LOWAT");
+
+    // listen() again on a listening socket just sets its backlog
+    int listening = 0;
+    socklen_t len = sizeof(listening);
+    if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) == 0 && listening &&
+        listen(fd, p->backlog) < 0) {
+        cerr << "listen() failed: " << strerror(errno) << endl;
+    }
+}
+
+
+/*
+ *  Create a socket listening on port with profile p.
+ *  Returns the fd or -1.
+ */
+int OpenListenSocket(unsigned short port, const struct sock_profile * p) {
+
+    int family = p->ipv6 ? AF_INET6 : AF_INET;
+    int fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+    if (fd < 0) {
+        cerr << "socket() failed" << endl;
+        return -1;
+    }
+    TuneListener(fd, p);
+
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    memset(&addr, 0, sizeof(addr));
+    if (p->ipv6) {
+        // IPv4 clients arrive as v4-mapped addresses
+        SetOption(fd, IPPROTO_IPV6, IPV6_V6ONLY, 0, "IPV6_V6ONLY");
+        struct sockaddr_in6 * sin6 = (struct sockaddr_in6 *)&addr;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_addr = in6addr_any;
+        sin6->sin6_port = htons(port);
+        addr_len = sizeof(*sin6);
+    }
+    else {
+        struct sockaddr_in * sin = (struct sockaddr_in *)&addr;
+        sin->sin_family = AF_INET;
+        sin->sin_addr.s_addr = htonl(INADDR_ANY);
+        sin->sin_port = htons(port);
+        addr_len = sizeof(*sin);
+    }
+
+    if (bind(fd, (struct sockaddr *)&addr, addr_len) < 0) {
+        cerr << "bind() failed: " << strerror(errno) << endl;
+        close(fd);
+        return -1;
+    }
+    if (listen(fd, p->backlog) < 0) {
+        cerr << "listen() failed " << endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
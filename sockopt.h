@@ -0,0 +1,54 @@
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+/*
+ *  Socket profiles for the listeners. A profile is a preset name and/or
+ *  a comma separated list of options, later ones overriding earlier ones,
+ *  e.g. "latency,sndbuf=262144" or "ipv6,defer_accept=1,nonodelay":
+ *
+ *      ipv6            listen on [::] in dual-stack mode
+ *      noreuseaddr     don't set SO_REUSEADDR (set by default)
+ *      nodelay         TCP_NODELAY (set by default)
+ *      nonodelay       don't set TCP_NODELAY, leaving Nagle's algorithm on
+ *      defer_accept=s  TCP_DEFER_ACCEPT: wake accept() only once request
+ *                      bytes are in, or after s seconds
+ *      fastopen=n      TCP_FASTOPEN with a queue of n pending connections
+ *                      (needs the server bit, 2, of net.ipv4.tcp_fastopen)
+ *      sndbuf=b        SO_SNDBUF
+ *      rcvbuf=b        SO_RCVBUF
+ *      busy_poll=us    SO_BUSY_POLL
+ *      notsent_lowat=b TCP_NOTSENT_LOWAT
+ *      backlog=n       listen() backlog (SOCK_BACKLOG by default; the
+ *                      kernel caps it at net.core.somaxconn)
+ *
+ *  All of them are set on the listening socket and accepted connections
+ *  inherit them from it, so accept() costs no extra syscalls. Every
+ *  option is set explicitly, so a listener inherited from an upgrading
+ *  server loses what the new profile leaves out, and a value of 0 turns
+ *  an option off. The exception is sndbuf and rcvbuf: setting a size
+ *  turns off the kernel's autotuning for good, so 0 leaves them alone,
+ *  and an inherited listener keeps any size set before.
+ */
+#define SOCK_LATENCY    "nodelay,defer_accept=1,busy_poll=50,notsent_lowat=16384"
+#define SOCK_THROUGHPUT "sndbuf=4194304,rcvbuf=4194304"
+#define SOCK_BACKLOG    511
+
+typedef struct sock_profile {
+    int ipv6;
+    int reuseaddr;
+    int nodelay;
+    int defer_accept;
+    int fastopen;
+    int sndbuf;
+    int rcvbuf;
+    int busy_poll;
+    int notsent_lowat;
+    int backlog;
+} sock_profile;
+
+void DefaultSockProfile(struct sock_profile * p);
+int ParseSockProfile(const char * spec, struct sock_profile * p);
+int OpenListenSocket(unsigned short port, const struct sock_profile * p);
+void TuneListener(int fd, const struct sock_profile * p);
+
+#endif // SOCKOPT_H
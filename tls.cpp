@@ -0,0 +1,241 @@
+#include "httpd.h"
+#include "tls.h"
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+using namespace std;
+
+static SSL_CTX * ctx = NULL;
+// the TLS state of every open HTTPS connection, indexed by fd
+static vector<SSL *> conns;
+
+
+static void PrintTLSError(const char * what) {
+
+    char buf[256];
+    unsigned long err = ERR_get_error();
+    if (err == 0) {
+        cerr << "tls: " << what << " failed" << endl;
+        return;
+    }
+    ERR_error_string_n(err, buf, sizeof(buf));
+    cerr << "tls: " << what << " failed: " << buf << endl;
+    ERR_clear_error();
+}
+
+
+static SSL * TLSConn(int fd) {
+
+    if (fd < 0 || (size_t)fd >= conns.size()) {
+        return NULL;
+    }
+    return conns[fd];
+}
+
+
+/*
+ *  Map a failed SSL_* call onto the errno conventions of the syscalls the
+ *  callers already handle: -1 with EINTR/EAGAIN for a retry, 0 for a
+ *  clean close and -1 with EIO for a protocol error.
+ */
+static ssize_t TLSResult(SSL * ssl, int rc) {
+
+    int saved = errno;
+    switch (SSL_get_error(ssl, rc)) {
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = saved != 0 ? saved : EAGAIN;
+            return -1;
+        case SSL_ERROR_SYSCALL:
+            ERR_clear_error();
+            if (saved == 0) {
+                return 0;
+            }
+            errno = saved;
+            return -1;
+        default:
+            PrintTLSError("record layer");
+            errno = EIO;
+            return -1;
+    }
+}
+
+
+/*
+ *  Load the certificate chain and key and set up the server context.
+ *  key_path may be NULL if the key is in the certificate file.
+ *  Returns 0 on success.
+ */
+int InitTLS(const char * cert_path, const char * key_path) {
+
+    if (key_path == NULL) {
+        key_path = cert_path;
+    }
+    SSL_CTX_free(ctx);
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        PrintTLSError("SSL_CTX_new()");
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // let OpenSSL push the keys into the kernel once the handshake is done;
+    // a client that hangs up without close_notify is just a closed socket
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // tickets carry the whole session, so no server side cache to share
+    // between workers
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    SSL_CTX_set_session_id_context(ctx, (const unsigned char *)SERV_NAME, strlen(SERV_NAME));
+
+    if (SSL_CTX_use_certificate_chain_file(ctx, cert_path) != 1) {
+        PrintTLSError(cert_path);
+    }
+    else if (SSL_CTX_use_PrivateKey_file(ctx, key_path, SSL_FILETYPE_PEM) != 1) {
+        PrintTLSError(key_path);
+    }
+    else if (SSL_CTX_check_private_key(ctx) != 1) {
+        PrintTLSError("key check");
+    }
+    else {
+        return 0;
+    }
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+    return -1;
+}
+
+
+void FreeTLS() {
+
+    SSL_CTX_free(ctx);
+    ctx = NULL;
+}
+
+
+/*
+ *  Run the server side of the handshake on a freshly accepted socket.
+ *  Returns 0 once the connection is ready for ConnRecv/ConnSend.
+ */
+int TLSAccept(int fd) {
+
+    if (ctx == NULL) {
+        return -1;
+    }
+    SSL * ssl = SSL_new(ctx);
+    if (ssl == NULL || SSL_set_fd(ssl, fd) != 1) {
+        PrintTLSError("SSL_new()");
+        SSL_free(ssl);
+        return -1;
+    }
+    while (1) {
+        ERR_clear_error();
+        errno = 0;
+        int rc = SSL_accept(ssl);
+        if (rc == 1) {
+            break;
+        }
+        if (TLSResult(ssl, rc) < 0 && errno == EINTR) {
+            continue;
+        }
+        cerr << "tls: handshake failed" << endl;
+        SSL_free(ssl);
+        return -1;
+    }
+    if ((size_t)fd >= conns.size()) {
+        conns.resize(fd + 1, NULL);
+    }
+    conns[fd] = ssl;
+    cerr << "tls: " << SSL_get_version(ssl) << " " << SSL_get_cipher_name(ssl)
+         << (SSL_session_reused(ssl) ? ", resumed" : "")
+         << (TLSKernelSend(fd) ? ", kTLS" : ", userspace records") << endl;
+    return 0;
+}
+
+
+/*
+ *  Whether the kernel encrypts what we send on fd.
+ */
+int TLSKernelSend(int fd) {
+
+    SSL * ssl = TLSConn(fd);
+    return ssl != NULL && BIO_get_ktls_send(SSL_get_wbio(ssl));
+}
+
+
+ssize_t ConnRecv(int fd, void * buffer, size_t len) {
+
+    SSL * ssl = TLSConn(fd);
+    if (ssl == NULL) {
+        return recv(fd, buffer, len, 0);
+    }
+    ERR_clear_error();
+    errno = 0;
+    int n = SSL_read(ssl, buffer, min(len, (size_t)INT_MAX));
+    return n > 0 ? n : TLSResult(ssl, n);
+}
+
+
+ssize_t ConnSend(int fd, const void * buffer, size_t len) {
+
+    SSL * ssl = TLSConn(fd);
+    if (ssl == NULL) {
+        return send(fd, buffer, len, 0);
+    }
+    ERR_clear_error();
+    errno = 0;
+    int n = SSL_write(ssl, buffer, min(len, (size_t)INT_MAX));
+    return n > 0 ? n : TLSResult(ssl, n);
+}
+
+
+/*
+ *  sendfile() for any connection. With kTLS the file pages go straight to
+ *  the kernel's record layer; without it the file is read and encrypted
+ *  one record at a time.
+ */
+ssize_t ConnSendfile(int fd, int in_fd, off_t * offset, size_t count) {
+
+    SSL * ssl = TLSConn(fd);
+    if (ssl == NULL) {
+        return sendfile(fd, in_fd, offset, count);
+    }
+    if (TLSKernelSend(fd)) {
+        ERR_clear_error();
+        errno = 0;
+        ossl_ssize_t n = SSL_sendfile(ssl, in_fd, *offset, count, 0);
+        if (n > 0) {
+            *offset += n;
+            return n;
+        }
+        return TLSResult(ssl, n);
+    }
+
+    char buffer[TLS_CHUNK];
+    ssize_t n = pread(in_fd, buffer, min(count, sizeof(buffer)), *offset);
+    if (n <= 0) {
+        return n;
+    }
+    n = ConnSend(fd, buffer, n);
+    if (n > 0) {
+        *offset += n;
+    }
+    return n;
+}
+
+
+/*
+ *  Send close_notify (without waiting for the peer's) and close fd.
+ */
+int ConnClose(int fd) {
+
+    SSL * ssl = TLSConn(fd);
+    if (ssl != NULL) {
+        ERR_clear_error();
+        SSL_shutdown(ssl);
+        SSL_free(ssl);
+        conns[fd] = NULL;
+    }
+    return close(fd);
+}
@@ -0,0 +1,34 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/*
+ *  HTTPS termination. OpenSSL only runs the handshake: with kTLS enabled it
+ *  then installs the session keys on the socket (TCP_ULP "tls" plus
+ *  TLS_TX/TLS_RX), so response bodies still go out with sendfile() and are
+ *  encrypted by the kernel without ever being copied into userspace. If
+ *  the kernel or cipher can't do kTLS, records are encrypted in userspace
+ *  with SSL_write instead.
+ *
+ *  Sessions resume with stateless tickets. The ticket keys are created
+ *  with the context, before prefork workers fork, so a ticket issued by
+ *  one worker is accepted by all of them.
+ *
+ *  The Conn* calls behave like the syscalls they are named after and fall
+ *  through to them for plain connections, so the request handling code
+ *  doesn't care which listener a connection came from.
+ */
+#define TLS_CHUNK 16384         // one full TLS record of plaintext
+
+int InitTLS(const char * cert_path, const char * key_path);
+void FreeTLS();
+int TLSAccept(int fd);
+int TLSKernelSend(int fd);
+ssize_t ConnRecv(int fd, void * buffer, size_t len);
+ssize_t ConnSend(int fd, const void * buffer, size_t len);
+ssize_t ConnSendfile(int fd, int in_fd, off_t * offset, size_t count);
+int ConnClose(int fd);
+
+#endif // TLS_H
@@ -0,0 +1,256 @@
+#include "httpd.h"
+#include "upgrade.h"
+#include <signal.h>
+#include <poll.h>
+#include <sys/wait.h>
+
+using namespace std;
+
+static char ** upgrade_argv = NULL;
+static char exe_path[PATH_MAX];
+static int listeners[UPGRADE_MAX_FDS];
+static int num_listeners = 0;
+static int ready_fd = -1;
+static int draining = 0;
+static int handoff = 1;
+static volatile sig_atomic_t upgrade_requested = 0;
+
+
+static void HandleSigusr2(int) {
+    upgrade_requested = 1;
+}
+
+
+/*
+ *  Remember how we were started so the upgrade can re-exec the same
+ *  command line. argv[0] is resolved now, while the cwd is still the one
+ *  it was relative to, and exec'd by path so that a binary renamed over
+ *  the old one is picked up.
+ */
+void SetUpgradeArgs(int, char * argv[]) {
+
+    upgrade_argv = argv;
+    if (strchr(argv[0], '/') == NULL || realpath(argv[0], exe_path) == NULL) {
+        strncpy(exe_path, argv[0], PATH_MAX - 1);
+    }
+}
+
+
+/*
+ *  SIGUSR2 is installed without SA_RESTART so a blocking recv() returns
+ *  EINTR and an idle connection can give way to the upgrade. The accept
+ *  loop only unblocks SIGUSR2 inside ppoll(), see ServeConnections.
+ */
+void InstallUpgradeHandler() {
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = HandleSigusr2;
+    sigaction(SIGUSR2, &sa, NULL);
+}
+
+
+void RegisterListener(int fd) {
+
+    if (num_listeners < UPGRADE_MAX_FDS) {
+        listeners[num_listeners++] = fd;
+    }
+}
+
+
+/*
+ *  If we were exec'd by an upgrading server, receive its listening
+ *  sockets. Returns the number of fds stored in fds, 0 on a normal start
+ *  and -1 if the handoff failed.
+ */
+int InheritListeners(int * fds, int max_fds) {
+
+    char * env = getenv(UPGRADE_ENV);
+    if (env == NULL) {
+        return 0;
+    }
+    ready_fd = atoi(env);
+    unsetenv(UPGRADE_ENV);
+
+    char data;
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    struct iovec iov;
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(ready_fd, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+        cerr << "upgrade: recvmsg() failed" << endl;
+        close(ready_fd);
+        ready_fd = -1;
+        return -1;
+    }
+    int n = 0;
+    for (struct cmsghdr * c = CMSG_FIRSTHDR(&msg); c != NULL; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        int count = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            if (n < max_fds) {
+                fds[n++] = fd;
+            }
+            else {
+                close(fd);
+            }
+        }
+    }
+    cerr << "upgrade: inherited " << n << " listening socket(s)" << endl;
+    return n;
+}
+
+
+/*
+ *  Tell the old process we are about to accept, so it can stop.
+ */
+void UpgradeReady() {
+
+    if (ready_fd < 0) {
+        return;
+    }
+    char ok = 1;
+    if (send(ready_fd, &ok, 1, MSG_NOSIGNAL) != 1) {
+        cerr << "upgrade: could not signal ready" << endl;
+    }
+    close(ready_fd);
+    ready_fd = -1;
+}
+
+
+/*
+ *  Fork/exec the new binary and pass it our listeners.
+ *  Returns 0 once the new process has taken over.
+ */
+static int StartUpgrade() {
+
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        cerr << "upgrade: socketpair() failed" << endl;
+        return -1;
+    }
+    // only the child's end may survive exec
+    fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+
+    char env[16];
+    snprintf(env, sizeof(env), "%d", sv[1]);
+    setenv(UPGRADE_ENV, env, 1);
+    pid_t pid = fork();
+    if (pid == 0) {
+        // the mask survives exec; the new server starts with none blocked
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        execv(exe_path, upgrade_argv);
+        _exit(127);
+    }
+    unsetenv(UPGRADE_ENV);
+    close(sv[1]);
+    if (pid < 0) {
+        cerr << "upgrade: fork() failed" << endl;
+        close(sv[0]);
+        return -1;
+    }
+
+    char data = 0;
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_FDS)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov;
+    iov.iov_base = &data;
+    iov.iov_len = 1;
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_listeners);
+    struct cmsghdr * c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * num_listeners);
+    memcpy(CMSG_DATA(c), listeners, sizeof(int) * num_listeners);
+
+    // wait for the new process to come up before letting go
+    int ok = sendmsg(sv[0], &msg, MSG_NOSIGNAL) == 1;
+    struct pollfd pfd;
+    pfd.fd = sv[0];
+    pfd.events = POLLIN;
+    if (ok) {
+        int rc;
+        do {
+            rc = poll(&pfd, 1, UPGRADE_READY_SECS * 1000);
+        } while (rc < 0 && errno == EINTR);
+        ok = rc == 1 && recv(sv[0], &data, 1, 0) == 1 && data == 1;
+    }
+    close(sv[0]);
+    if (!ok) {
+        cerr << "upgrade: new process " << pid << " did not start, still serving" << endl;
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    cerr << "upgrade: handed over to pid " << pid << endl;
+    return 0;
+}
+
+
+/*
+ *  Called from the accept loop (or the prefork master) before it blocks,
+ *  never in the middle of a response: the handoff may wait up to
+ *  UPGRADE_READY_SECS for the new process. Performs a pending upgrade
+ *  and, once it succeeds, stops listening and arms the drain deadline.
+ *  Returns 1 if the server is draining.
+ */
+int CheckUpgrade() {
+
+    if (!upgrade_requested || draining) {
+        return draining;
+    }
+    upgrade_requested = 0;
+    if (handoff && (num_listeners == 0 || StartUpgrade() != 0)) {
+        return 0;
+    }
+    for (int i = 0; i < num_listeners; i++) {
+        close(listeners[i]);
+    }
+    num_listeners = 0;
+    draining = 1;
+    // hard stop for clients that never finish; SIGALRM's default
+    // action terminates the process
+    alarm(UPGRADE_DRAIN_SECS);
+    return 1;
+}
+
+
+/*
+ *  Prefork workers share the master's listener; SIGUSR2 from the master
+ *  only tells them to drain, the master does the handoff itself.
+ */
+void DisableHandoff() {
+    handoff = 0;
+}
+
+
+int Draining() {
+    return draining;
+}
+
+
+/*
+ *  Whether an upgrade has been asked for or is draining us. Connections
+ *  check this to close rather than keep the accept loop waiting.
+ */
+int UpgradePending() {
+    return upgrade_requested || draining;
+}
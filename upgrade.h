@@ -0,0 +1,28 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+/*
+ *  Zero-downtime binary upgrades. On SIGUSR2 the running server forks and
+ *  execs its own binary path (which may since have been replaced on disk)
+ *  and hands the listening sockets to the new process over a UNIX socket
+ *  with SCM_RIGHTS. Once the new process reports it is ready, the old one
+ *  stops accepting, finishes in-flight requests (closing kept-alive
+ *  connections after their current response) and exits. If the new binary
+ *  never reports ready, the old process keeps serving as before.
+ */
+#define UPGRADE_ENV         "HTTPD_UPGRADE_FD"
+#define UPGRADE_MAX_FDS     8
+#define UPGRADE_READY_SECS  10
+#define UPGRADE_DRAIN_SECS  30
+
+void SetUpgradeArgs(int argc, char * argv[]);
+void InstallUpgradeHandler();
+int InheritListeners(int * fds, int max_fds);
+void UpgradeReady();
+void RegisterListener(int fd);
+int CheckUpgrade();
+void DisableHandoff();
+int Draining();
+int UpgradePending();
+
+#endif // UPGRADE_H